@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
 #include "morpheus.h"
 
 static struct client* client_list;
@@ -19,6 +20,7 @@ struct client* client_new(int sock, struct sockaddr* addr, socklen_t len){
 	client->epoll_irc_tag = EPOLL_TAG_IRC_CLIENT;
 	client->irc_sock = sock;
 	client->connect_time = client->last_cmd_time = time(0);
+	client->irc_iconv = (iconv_t)-1;
 
 	char host[INET6_ADDRSTRLEN] = {};
 	char port[8] = {};
@@ -47,25 +49,25 @@ void client_del(struct client* client){
 	epoll_ctl(global.epoll, EPOLL_CTL_DEL, client->irc_sock, NULL);
 	close(client->irc_sock);
 
+	// the matrix side keeps going without us, see session_tick
+	session_detach(client);
+	directory_list_free(client);
+
 	free(client->irc_nick);
 	free(client->irc_user);
 	free(client->irc_pass);
+	free(client->irc_charset);
 
-	free(client->mtx_token);
-	free(client->mtx_since);
-	free(client->mtx_server);
-
-	sb_each(id, client->mtx_sent_ids) free(*id);
-	sb_free(client->mtx_sent_ids);
+	if(client->irc_iconv != (iconv_t)-1){
+		iconv_close(client->irc_iconv);
+	}
 
+	sb_each(r, client->irc_rooms){
+		room_unref(room_lookup_mtx(*r));
+	}
 	sb_free(client->irc_rooms);
 	sb_free(client->irc_buf);
-
-	for(struct net_msg* msg = client->msgs; msg; /**/){
-		struct net_msg* tmp = msg->next;
-		net_msg_free(msg);
-		msg = tmp;
-	}
+	sb_free(client->irc_out);
 
 	for(struct client** c = &client_list; *c; c = &(*c)->next){
 		if(*c == client){
@@ -77,6 +79,33 @@ void client_del(struct client* client){
 	free(client);
 }
 
+// EPOLLOUT stays on while there's queued output, or while the caller (a LIST) wants it
+void client_epollout(struct client* client, bool enable){
+	struct epoll_event ev = {
+		.events = EPOLLIN | EPOLLRDHUP | (enable || sb_count(client->irc_out) ? EPOLLOUT : 0),
+		.data.ptr = &client->epoll_irc_tag
+	};
+	epoll_ctl(global.epoll, EPOLL_CTL_MOD, client->irc_sock, &ev);
+}
+
+// sends what it can of irc_out, returns false if the socket is broken
+bool client_flush(struct client* client){
+	size_t len = sb_count(client->irc_out);
+	if(len == 0) return true;
+
+	ssize_t n = send(client->irc_sock, client->irc_out, len, 0);
+	if(n == -1){
+		if(errno == EAGAIN || errno == EWOULDBLOCK) return true;
+		perror("send");
+		return false;
+	}
+
+	memmove(client->irc_out, client->irc_out + n, len - n);
+	stb__sbn(client->irc_out) = len - n;
+
+	return true;
+}
+
 void client_tick(){
 	time_t now = time(0);
 
@@ -90,24 +119,9 @@ void client_tick(){
 				disconnect = true;
 			} else {
 				if(!((*c)->irc_state & IRC_STATE_IDLE) && cmd_diff >= 60){
-					send((*c)->irc_sock, "PING :morpheus\r\n", 16, 0);
+					irc_send_raw(*c, "PING :morpheus\r\n", 16);
 					(*c)->irc_state |= IRC_STATE_IDLE;
 				}
-
-				int pending_msgs = 0;
-				for(struct net_msg* tmp = (*c)->msgs; tmp; tmp = tmp->next){
-					if(!tmp->done) pending_msgs++;
-				}
-
-				if(!(*c)->next_sync && pending_msgs == 0){
-					printf("WARNING: client %d has no sync ongoing?\n", (*c)->irc_sock);
-					IRC_SEND(*c, "NOTICE", (*c)->irc_nick, "[debug] sync timed out? that's just not cricket.");
-					mtx_send_sync(*c);
-					(*c)->next_sync = 0;
-				} else if((*c)->next_sync && now > (*c)->next_sync){
-					mtx_send_sync(*c);
-					(*c)->next_sync = 0;
-				}
 			}
 		} else {
 			disconnect = now - (*c)->connect_time > 15 || now - (*c)->last_cmd_time > 5;
@@ -120,4 +134,63 @@ void client_tick(){
 			c = &(*c)->next;
 		}
 	}
+
+	session_tick();
+	room_tick();
+	directory_tick();
+	profile_tick();
+}
+
+struct client* client_find(int irc_sock){
+	for(struct client* c = client_list; c; c = c->next){
+		if(c->irc_sock == irc_sock) return c;
+	}
+	return NULL;
+}
+
+// the converter for client input that isn't valid UTF-8, or (iconv_t)-1 if there isn't one.
+iconv_t client_iconv(struct client* client){
+	if(client->irc_iconv == (iconv_t)-1){
+		const char* charset = client->irc_charset ?: global.irc_charset;
+
+		client->irc_iconv = iconv_open("UTF-8", charset);
+		if(client->irc_iconv == (iconv_t)-1){
+			printf("[%02d] Can't convert from charset [%s]\n", client->irc_sock, charset);
+		}
+	}
+
+	return client->irc_iconv;
+}
+
+void client_set_charset(struct client* client, const char* charset){
+	free(client->irc_charset);
+	client->irc_charset = strdup(charset);
+
+	if(client->irc_iconv != (iconv_t)-1){
+		iconv_close(client->irc_iconv);
+		client->irc_iconv = (iconv_t)-1;
+	}
+}
+
+bool client_in_room(struct client* client, mtx_id room){
+	sb_each(r, client->irc_rooms){
+		if(*r == room) return true;
+	}
+	return false;
+}
+
+// irc_rooms holds a reference to each room, so they aren't swept while it's showing them.
+void client_room_add(struct client* client, struct room* room){
+	sb_push(client->irc_rooms, room->id);
+	room_ref(room);
+}
+
+void client_room_del(struct client* client, struct room* room){
+	sb_each(r, client->irc_rooms){
+		if(*r == room->id){
+			sb_erase(client->irc_rooms, r - client->irc_rooms);
+			room_unref(room);
+			break;
+		}
+	}
 }
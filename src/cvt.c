@@ -1,6 +1,11 @@
 #include "morpheus.h"
 #include <wchar.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
+// nick!user@host for a matrix user, in scratch memory
 char* cvt_m2i_user(mtx_id user_id){
 	assert(user_id);
 
@@ -11,16 +16,12 @@ char* cvt_m2i_user(mtx_id user_id){
 
 	int n = colon - user;
 
-	char* result;
 	if(strcmp(colon+1, global.mtx_server_name) == 0){
-		asprintf(&result, "%.*s!%.*s@%s", n, user, n, user, colon+1);
+		return scratch_printf("%.*s!%.*s@%s", n, user, n, user, colon+1);
 	} else {
 		int hash = id_server_hash(user_id);
-		asprintf(&result, "%.*s`%04hx!%.*s@%s", n, user, hash, n, user, colon+1);
+		return scratch_printf("%.*s`%04hx!%.*s@%s", n, user, hash, n, user, colon+1);
 	}
-
-	assert(result);
-	return result;
 }
 
 mtx_id cvt_i2m_user(const char* user){
@@ -48,11 +49,23 @@ static const char* colors[] = {
 	"blue"  , "fuchsia", "gray"  , "silver",
 };
 
-sb(char) cvt_m2i_msg_plain(const char* msg){
-	sb(char) out = NULL;
+// the messages are built up in here, then copied into scratch memory
+static sb(char) cvt_buf;
+
+static char* cvt_buf_done(sb(char) out){
+	cvt_buf = out;
+	stb__sbn(cvt_buf) = 0;
+	return scratch_strndup(out, strlen(out));
+}
+
+char* cvt_m2i_msg_plain(const char* msg){
+	sb(char) out = cvt_buf;
 
+	// newlines are kept, see irc_split_next
 	for(const char* c = msg; *c; ++c){
-		if(*(uint8_t*)c > 0x03 && *(uint8_t*)c < ' '){
+		if(*c == '\r'){
+			continue;
+		} else if(*(uint8_t*)c > 0x03 && *(uint8_t*)c < ' ' && *c != '\n'){
 			sb_push(out, ' ');
 		} else {
 			sb_push(out, *c);
@@ -60,12 +73,19 @@ sb(char) cvt_m2i_msg_plain(const char* msg){
 	}
 
 	sb_push(out, 0);
-	return out;
+	return cvt_buf_done(out);
 }
 
 static uint8_t html_tag_to_irc(const char* tag, size_t len){
 	if(!tag || *tag != '<') return 0;
 
+	// line breaks, handed on as newlines
+	if((len >= 3 && strncmp(tag, "<br", 3) == 0 && (len == 3 || tag[3] == '/' || tag[3] == ' '))
+	|| (len == 3 && strncmp(tag, "</p", 3) == 0)
+	|| (len == 4 && (strncmp(tag, "</li", 4) == 0 || strncmp(tag, "</h", 3) == 0))){
+		return '\n';
+	}
+
 	if(len == 2 || (len == 3 && tag[1] == '/')){
 		switch(tag[len-1]){
 			case 'b': return 0x02;
@@ -98,8 +118,8 @@ static uint8_t html_tag_to_irc(const char* tag, size_t len){
 	return 0;
 }
 
-sb(char) cvt_m2i_msg_rich(const char* msg){
-	sb(char) out = NULL;
+char* cvt_m2i_msg_rich(const char* msg){
+	sb(char) out = cvt_buf;
 
 	while(*msg){
 		if(*msg == '<'){ // strip / convert  html tags
@@ -107,7 +127,9 @@ sb(char) cvt_m2i_msg_rich(const char* msg){
 			char* end = strchrnul(msg+1, '>');
 
 			uint8_t code = html_tag_to_irc(msg, end - msg);
-			if(code >= '0'){ // colour
+			if(code == '\n'){
+				sb_push(out, '\n');
+			} else if(code >= '0'){ // colour
 				code -= '0';
 				sb_push(out, 0x03);
 				sb_push(out, (code / 10) + '0');
@@ -143,6 +165,9 @@ sb(char) cvt_m2i_msg_rich(const char* msg){
 			if(sb_count(out) != orig_count) msg = end;
 			if(*msg) ++msg;
 
+		} else if(*msg == '\n' || *msg == '\r'){ // kept for <pre> blocks, see irc_split_next
+			if(*msg == '\n') sb_push(out, '\n');
+			++msg;
 		} else if(*(uint8_t*)msg < ' ' && *(uint8_t*)msg > 1){ // strip control chars
 			sb_push(out, ' ');
 			++msg;
@@ -153,7 +178,7 @@ sb(char) cvt_m2i_msg_rich(const char* msg){
 	}
 
 	sb_push(out, 0);
-	return out;
+	return cvt_buf_done(out);
 }
 
 static void add_char_escaped(uint8_t c, sb(char)* out){
@@ -284,3 +309,101 @@ sb(char) cvt_i2m_msg(const char* msg, sb(char)* stripped){
 
 	return out;
 }
+
+// length of the UTF-8 sequence at s (at most len bytes), or 0 if it isn't valid.
+// Overlong forms, surrogates and anything past U+10FFFF don't count.
+static size_t utf8_seq_len(const uint8_t* s, size_t len){
+	uint8_t c = s[0];
+
+	if(c < 0x80) return 1;
+	if(c < 0xC2 || c > 0xF4) return 0;
+
+	size_t n = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+	if(len < n) return 0;
+
+	for(size_t i = 1; i < n; ++i){
+		if((s[i] & 0xC0) != 0x80) return 0;
+	}
+
+	if(c == 0xE0 && s[1] < 0xA0) return 0; // overlong
+	if(c == 0xED && s[1] > 0x9F) return 0; // surrogate
+	if(c == 0xF0 && s[1] < 0x90) return 0; // overlong
+	if(c == 0xF4 && s[1] > 0x8F) return 0; // > U+10FFFF
+
+	return n;
+}
+
+// how much of str is valid UTF-8, i.e. len if all of it is.
+// Nearly everything that comes from IRC is ASCII, so that's checked 16 bytes at a time.
+size_t cvt_utf8_valid(const char* str, size_t len){
+	const uint8_t* s = (const uint8_t*)str;
+	size_t i = 0;
+
+	while(i < len){
+#ifdef __SSE2__
+		while(i + 16 <= len){
+			__m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+			if(_mm_movemask_epi8(v)) break;
+			i += 16;
+		}
+		if(i >= len) break;
+#endif
+		if(s[i] < 0x80){
+			++i;
+			continue;
+		}
+
+		size_t n = utf8_seq_len(s + i, len - i);
+		if(!n) return i;
+		i += n;
+	}
+
+	return len;
+}
+
+// converts the parts of str that aren't valid UTF-8 from the charset cd converts
+// from (see client_iconv), leaving the rest alone. Anything cd can't make sense
+// of becomes U+FFFD.
+sb(char) cvt_charset_fix(iconv_t cd, const char* str, size_t len){
+	const uint8_t* s = (const uint8_t*)str;
+	sb(char) out = NULL;
+
+	size_t i = 0;
+	while(i < len){
+		size_t valid = cvt_utf8_valid(str + i, len - i);
+		memcpy(sb_add(out, valid), str + i, valid);
+		i += valid;
+
+		// the run of bytes that aren't UTF-8
+		size_t end = i;
+		while(end < len && (s[end] < 0x80 ? false : !utf8_seq_len(s + end, len - end))) ++end;
+
+		while(i < end){
+			if(cd == (iconv_t)-1){
+				memcpy(sb_add(out, 3), "\xEF\xBF\xBD", 3);
+				++i;
+				continue;
+			}
+
+			char buf[64];
+			char* in = (char*)str + i;
+			char* o = buf;
+			size_t in_left = end - i, out_left = sizeof(buf);
+
+			size_t r = iconv(cd, &in, &in_left, &o, &out_left);
+			memcpy(sb_add(out, o - buf), buf, o - buf);
+
+			// E2BIG just means buf filled up, unless nothing fit in it at all
+			if(r == (size_t)-1 && (errno != E2BIG || o == buf)){
+				iconv(cd, NULL, NULL, NULL, NULL);
+				memcpy(sb_add(out, 3), "\xEF\xBF\xBD", 3);
+				++in;
+			}
+
+			i = in - str;
+		}
+	}
+
+	sb_push(out, 0);
+	return out;
+}
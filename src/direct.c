@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <yajl/yajl_gen.h>
+#include "morpheus.h"
+#include "inso_ht.h"
+
+// Each session's 1:1 rooms, from its m.direct account data, so PMs can find their
+// room without scanning every room we're in, and so we only ever create one.
+
+#define I2V(x) ((void*)(uintptr_t)(x))
+
+struct direct_entry {
+	mtx_id     user;
+	mtx_id     created;  // made by us this run, so not in room_list until the next sync
+	bool       creating; // a createRoom is in flight, PMs wait in pending
+	bool       deferred; // PMs are waiting in pending for m.direct to load, see direct_defer
+	sb(mtx_id) rooms;
+	sb(char*)  pending;
+};
+
+struct direct_slot {
+	mtx_id   user; // must be first member
+	uint32_t index;
+};
+
+struct direct_index {
+	inso_ht slots;
+	sb(struct direct_entry) entries;
+	bool loaded;  // direct_update has seen the server's m.direct, we may write it back
+	bool loading; // the GET for it is in flight
+};
+
+static size_t direct_hash(const void* entry){
+	uint32_t x = *(uint32_t*)entry;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = (x >> 16) ^ x;
+	return x;
+}
+
+static bool direct_cmp(const void* entry, void* param){
+	return I2V(*(uint32_t*)entry) == param;
+}
+
+static struct direct_index* direct_index(struct session* sess){
+	struct direct_index* idx = sess->direct;
+
+	if(!idx){
+		idx = sess->direct = calloc(1, sizeof(*idx));
+		inso_ht_init(&idx->slots, 16, sizeof(struct direct_slot), &direct_hash);
+	}
+
+	return idx;
+}
+
+static struct direct_entry* direct_get(struct session* sess, mtx_id user, bool create){
+	if(!sess->direct && !create) return NULL;
+	struct direct_index* idx = direct_index(sess);
+
+	struct direct_slot* slot = inso_ht_get(&idx->slots, direct_hash(&user), &direct_cmp, I2V(user));
+	if(slot) return idx->entries + slot->index;
+	if(!create) return NULL;
+
+	struct direct_slot s = { .user = user, .index = sb_count(idx->entries) };
+	inso_ht_put(&idx->slots, &s);
+
+	sb_push(idx->entries, (struct direct_entry){ .user = user });
+	return &sb_last(idx->entries);
+}
+
+static bool direct_room_joined(struct session* sess, mtx_id id){
+	struct room* room = room_lookup_mtx(id);
+	if(!room) return false;
+
+	struct member* self = room_member_get(room, sess->mtx_id);
+	return self && self->state == MEMBER_STATE_JOINED;
+}
+
+// the room to PM user in, if we have one.
+struct room* direct_room(struct session* sess, mtx_id user){
+	struct direct_entry* e = direct_get(sess, user, false);
+	if(!e) return NULL;
+
+	if(e->created){
+		if(!direct_room_joined(sess, e->created)){
+			return room_new(e->created);
+		}
+		e->created = 0;
+	}
+
+	sb_each(r, e->rooms){
+		if(direct_room_joined(sess, *r)){
+			return room_lookup_mtx(*r);
+		}
+	}
+
+	return NULL;
+}
+
+// replaces the index with the content of an m.direct event, or empties it if content
+// is NULL because the user doesn't have one. Rooms and PMs that are waiting on a
+// createRoom are kept.
+void direct_update(struct session* sess, json_val content){
+	if(content && !JSON_IS_OBJECT(content)) return;
+
+	struct direct_index* idx = direct_index(sess);
+	sb_each(e, idx->entries){
+		sb_free(e->rooms);
+		if(e->created){
+			sb_push(e->rooms, e->created);
+		}
+	}
+
+	idx->loaded  = true;
+	idx->loading = false;
+
+	for(size_t i = 0; content && i < content->u.object.len; ++i){
+		json_val rooms = content->u.object.values[i];
+		if(!JSON_IS_ARRAY(rooms)) continue;
+
+		struct direct_entry* e = direct_get(sess, id_intern(content->u.object.keys[i]), true);
+
+		for(size_t j = 0; j < rooms->u.array.len; ++j){
+			if(!JSON_IS_STRING(rooms->u.array.values[j])) continue;
+			mtx_id room = id_intern(json_str(rooms->u.array.values[j]));
+			if(room != e->created){
+				sb_push(e->rooms, room);
+			}
+		}
+	}
+
+	printf("[%s] m.direct has %zu users\n", sess->user, content ? content->u.object.len : 0);
+}
+
+// whether the index has the server's m.direct in it yet. Until it does, we can't tell
+// if a PM needs a new room, and writing it back would wipe out the user's other DMs.
+bool direct_loaded(struct session* sess){
+	return sess->direct && sess->direct->loaded;
+}
+
+// holds on to a PM until m.direct has loaded, see direct_flush. Returns true if
+// the caller should fetch it.
+bool direct_defer(struct session* sess, mtx_id user, const char* text){
+	struct direct_entry* e = direct_get(sess, user, true);
+	sb_push(e->pending, strdup(text));
+	e->deferred = true;
+
+	struct direct_index* idx = sess->direct;
+	if(idx->loading) return false;
+
+	idx->loading = true;
+	return true;
+}
+
+// m.direct has loaded, so the deferred PMs can go to the room they belong in, or
+// get one made for them. With failed set it couldn't be loaded and they're dropped.
+void direct_flush(struct session* sess, bool failed){
+	struct direct_index* idx = sess->direct;
+	if(!idx) return;
+
+	if(failed){
+		idx->loading = false;
+	}
+
+	for(size_t i = 0; i < sb_count(idx->entries); ++i){
+		struct direct_entry* e = idx->entries + i;
+		if(!e->deferred) continue;
+
+		mtx_id user = e->user;
+		sb(char*) pending = e->pending;
+		e->pending  = NULL;
+		e->deferred = false;
+
+		// mtx_send_pm can add entries, so e isn't used after this
+		if(failed){
+			SESSION_SEND_NUM(sess, "NOTICE", "Error sending PM");
+		} else {
+			struct room* room = direct_room(sess, user) ?: room_find_query(sess, user);
+			sb_each(t, pending){
+				if(room){
+					mtx_send_msg(sess, NULL, room, *t);
+				} else {
+					mtx_send_pm(sess, user, *t);
+				}
+			}
+		}
+
+		sb_each(t, pending) free(*t);
+		sb_free(pending);
+	}
+}
+
+// sends text to user once their room exists. Returns false if nobody is creating
+// it yet, in which case the caller should.
+bool direct_queue(struct session* sess, mtx_id user, const char* text){
+	struct direct_entry* e = direct_get(sess, user, true);
+	sb_push(e->pending, strdup(text));
+
+	if(e->creating) return true;
+
+	e->creating = true;
+	return false;
+}
+
+// createRoom finished, with room 0 if it failed.
+void direct_created(struct session* sess, mtx_id user, mtx_id room_id){
+	struct direct_entry* e = direct_get(sess, user, true);
+	e->creating = false;
+
+	if(room_id){
+		e->created = room_id;
+		sb_push(e->rooms, room_id);
+
+		struct room* room = room_new(room_id);
+		sb_each(t, e->pending){
+			mtx_send_msg(sess, NULL, room, *t);
+		}
+	}
+
+	sb_each(t, e->pending) free(*t);
+	sb_free(e->pending);
+}
+
+// the whole m.direct content, for writing it back after we've added a room.
+char* direct_json(struct session* sess){
+	struct direct_index* idx = sess->direct;
+	assert(idx && idx->loaded);
+
+	yajl_gen json = yajl_gen_alloc(NULL);
+
+	yajl_gen_map_open(json);
+	sb_each(e, idx->entries){
+		if(!sb_count(e->rooms)) continue;
+
+		const char* user = id_lookup(e->user);
+		yajl_gen_string(json, user, strlen(user));
+
+		yajl_gen_array_open(json);
+		sb_each(r, e->rooms){
+			const char* room = id_lookup(*r);
+			yajl_gen_string(json, room, strlen(room));
+		}
+		yajl_gen_array_close(json);
+	}
+	yajl_gen_map_close(json);
+
+	const uint8_t* buf = NULL;
+	size_t sz;
+	yajl_gen_get_buf(json, &buf, &sz);
+	char* result = strndup(buf, sz);
+
+	yajl_gen_free(json);
+	return result;
+}
+
+void direct_free(struct session* sess){
+	struct direct_index* idx = sess->direct;
+	if(!idx) return;
+
+	sb_each(e, idx->entries){
+		sb_each(t, e->pending) free(*t);
+		sb_free(e->pending);
+		sb_free(e->rooms);
+	}
+	sb_free(idx->entries);
+	inso_ht_free(&idx->slots);
+	free(idx);
+
+	sess->direct = NULL;
+}
@@ -0,0 +1,302 @@
+#include <sys/epoll.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <string.h>
+#include "morpheus.h"
+
+// A cached copy of the homeserver's public room directory, for LIST.
+// It's refreshed in the background every DIRECTORY_REFRESH_SECS, and each
+// refresh builds a new snapshot so LISTs in progress can keep using the old one.
+
+#define DIRECTORY_REFRESH_SECS 600
+#define DIRECTORY_LINES_PER_WAKE 64
+
+struct dir_entry {
+	char* name;  // the IRC channel name
+	char* topic;
+	int   users;
+};
+
+struct dir_snapshot {
+	int refs;
+	sb(struct dir_entry) entries; // sorted by users, highest first
+};
+
+// An in-progress LIST, sent a chunk at a time whenever the client's socket is writable.
+struct dir_list {
+	struct dir_snapshot* snap;
+	size_t pos;
+	size_t end;
+	sb(char*) masks;
+};
+
+static struct dir_snapshot* dir_current;
+static struct dir_snapshot* dir_building;
+static time_t dir_refreshed;
+
+// which fetch dir_building is for. Each page's request carries it, so that pages from
+// a fetch that has been given up on can't end up in the next one.
+static uint32_t dir_generation;
+
+// clients that sent LIST before we had anything to show them
+static sb(struct client*) dir_waiting;
+
+static void dir_snapshot_unref(struct dir_snapshot* snap){
+	if(!snap || --snap->refs > 0) return;
+
+	sb_each(e, snap->entries){
+		free(e->name);
+		free(e->topic);
+	}
+	sb_free(snap->entries);
+	free(snap);
+}
+
+static int dir_entry_cmp(const void* a, const void* b){
+	return ((struct dir_entry*)b)->users - ((struct dir_entry*)a)->users;
+}
+
+// first index in [0, count) whose users are <= n, the entries being sorted in descending order
+static size_t dir_lower(struct dir_snapshot* snap, int n){
+	size_t lo = 0, hi = sb_count(snap->entries);
+	while(lo < hi){
+		size_t mid = (lo + hi) / 2;
+		if(snap->entries[mid].users > n){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static void dir_start(struct client* client){
+	struct dir_list* list = client->irc_list;
+
+	list->snap = dir_current;
+	list->snap->refs++;
+	list->pos = 0;
+	list->end = sb_count(dir_current->entries);
+
+	// narrow the range down with the user count conditions, the rest is done while sending
+	for(size_t i = 0; i < sb_count(list->masks); /**/){
+		const char* m = list->masks[i];
+		char* end;
+
+		if((*m == '>' || *m == '<') && m[1]){
+			long n = strtol(m + 1, &end, 10);
+			if(!*end){
+				if(*m == '>'){
+					list->end = MIN(list->end, dir_lower(list->snap, n));
+				} else {
+					list->pos = MAX(list->pos, dir_lower(list->snap, n - 1));
+				}
+				free(list->masks[i]);
+				sb_erase(list->masks, i);
+				continue;
+			}
+		}
+		++i;
+	}
+
+	IRC_SEND_NUM(client, "321", "Channel", "Users  Name");
+	client_epollout(client, true);
+}
+
+// starts or ends the LISTs that were waiting on a fetch
+static void dir_flush_waiting(void){
+	sb(struct client*) waiting = dir_waiting;
+	dir_waiting = NULL;
+
+	sb_each(c, waiting){
+		struct client* client = *c;
+		if(dir_current){
+			dir_start(client);
+		} else {
+			IRC_SEND_NUM(client, "323", "End of /LIST");
+			directory_list_free(client);
+		}
+	}
+	sb_free(waiting);
+}
+
+static void dir_refresh(void){
+	struct session* sess = session_any();
+	if(!sess || dir_building) return;
+
+	printf("Refreshing room directory using [%s]\n", sess->user);
+
+	dir_building = calloc(1, sizeof(*dir_building));
+	dir_building->refs = 1;
+	dir_refreshed = time(0);
+
+	mtx_send_directory(sess, NULL, ++dir_generation);
+}
+
+void directory_tick(void){
+	// the session it was using went away mid-fetch
+	if(dir_building && time(0) - dir_refreshed >= DIRECTORY_REFRESH_SECS / 4){
+		dir_snapshot_unref(dir_building);
+		dir_building = NULL;
+		dir_generation++;
+		dir_flush_waiting();
+	}
+
+	if(time(0) - dir_refreshed >= DIRECTORY_REFRESH_SECS){
+		dir_refresh();
+	}
+}
+
+void directory_recv(struct session* sess, struct net_msg* msg, json_val root){
+	if(!dir_building || (uintptr_t)msg->user_data != dir_generation) return;
+
+	json_val chunk = JSON_GET(root, JSON_ARRAY , ("chunk"));
+	json_val next  = JSON_GET(root, JSON_STRING, ("next_batch"));
+
+	if(msg->curl_status != 200 || !chunk){
+		printf("[%s] Room directory fetch failed [%ld]\n", sess->user, msg->curl_status);
+
+		// keep whatever we had, and try again next refresh
+		dir_snapshot_unref(dir_building);
+		dir_building = NULL;
+		next = NULL;
+	} else {
+		size_t server_len = strlen(global.mtx_server_name);
+
+		for(size_t i = 0; i < chunk->u.array.len; ++i){
+			json_val room  = chunk->u.array.values[i];
+			json_val alias = JSON_GET(room, JSON_STRING, ("canonical_alias"));
+			json_val users = JSON_GET(room, JSON_NUMBER, ("num_joined_members"));
+			json_val topic = JSON_GET(room, JSON_STRING, ("topic"));
+
+			// only our own aliases can be JOINed by name, see mtx_send_join
+			if(!alias) continue;
+			const char* colon = strchr(json_str(alias), ':');
+			if(!colon || strlen(colon + 1) != server_len || strcmp(colon + 1, global.mtx_server_name) != 0) continue;
+
+			struct dir_entry e = {
+				.name  = strndup(json_str(alias), colon - json_str(alias)),
+				.topic = strdup(topic ? json_str(topic) : ""),
+				.users = JSON_IS_INTEGER(users) ? users->u.number.i : 0,
+			};
+
+			for(char* c = e.topic; *c; ++c){
+				if(*c == '\r' || *c == '\n') *c = ' ';
+			}
+
+			// keep the 322 well under the line limit, without splitting a UTF-8 sequence
+			size_t len = strlen(e.topic);
+			if(len > 300){
+				len = 300;
+				while(len > 0 && (e.topic[len] & 0xC0) == 0x80) --len;
+				e.topic[len] = '\0';
+			}
+
+			sb_push(dir_building->entries, e);
+		}
+	}
+
+	if(next){
+		mtx_send_directory(sess, json_str(next), dir_generation);
+		return;
+	}
+
+	if(dir_building){
+		qsort(dir_building->entries, sb_count(dir_building->entries), sizeof(struct dir_entry), &dir_entry_cmp);
+		printf("Room directory has %zu rooms\n", sb_count(dir_building->entries));
+
+		dir_snapshot_unref(dir_current);
+		dir_current = dir_building;
+		dir_building = NULL;
+	}
+
+	dir_flush_waiting();
+}
+
+void directory_list(struct client* client, const char* params){
+	directory_list_free(client);
+
+	struct dir_list* list = calloc(1, sizeof(*list));
+	client->irc_list = list;
+
+	if(params){
+		char* state;
+		char* copy = strdupa(params);
+		for(char* m = strtok_r(copy, ",", &state); m; m = strtok_r(NULL, ",", &state)){
+			sb_push(list->masks, strdup(m));
+		}
+	}
+
+	if(dir_current){
+		dir_start(client);
+	} else {
+		sb_push(dir_waiting, client);
+		dir_refresh();
+
+		// no session to fetch it with
+		if(!dir_building){
+			IRC_SEND_NUM(client, "323", "End of /LIST");
+			directory_list_free(client);
+		}
+	}
+}
+
+void directory_list_continue(struct client* client){
+	struct dir_list* list = client->irc_list;
+
+	if(!list || !list->snap){
+		client_epollout(client, false);
+		return;
+	}
+
+	// wait for the last batch to leave before queueing more behind it
+	if(sb_count(client->irc_out)){
+		return;
+	}
+
+	for(int sent = 0; list->pos < list->end && sent < DIRECTORY_LINES_PER_WAKE && !sb_count(client->irc_out); ++list->pos){
+		struct dir_entry* e = list->snap->entries + list->pos;
+
+		bool match = sb_count(list->masks) == 0;
+		sb_each(m, list->masks){
+			if(fnmatch(*m, e->name, FNM_CASEFOLD) == 0){
+				match = true;
+				break;
+			}
+		}
+		if(!match) continue;
+
+		char users[16];
+		snprintf(users, sizeof(users), "%d", e->users);
+		IRC_SEND_NUM(client, "322", e->name, users, e->topic);
+		++sent;
+	}
+
+	if(list->pos >= list->end){
+		IRC_SEND_NUM(client, "323", "End of /LIST");
+		directory_list_free(client);
+	}
+}
+
+void directory_list_free(struct client* client){
+	struct dir_list* list = client->irc_list;
+	if(!list) return;
+
+	sb_each(c, dir_waiting){
+		if(*c == client){
+			sb_erase(dir_waiting, c - dir_waiting);
+			break;
+		}
+	}
+
+	if(list->snap){
+		dir_snapshot_unref(list->snap);
+		client_epollout(client, false);
+	}
+
+	sb_each(m, list->masks) free(*m);
+	sb_free(list->masks);
+	free(list);
+
+	client->irc_list = NULL;
+}
@@ -23,7 +23,9 @@ typedef struct {
 	void  (*free_fn)(void*, size_t);
 } inso_ht;
 
-#ifndef NDEBUG
+// tracing of every put / del / rehash, only with -DINSO_HT_DEBUG. It's far too
+// chatty to have on whenever asserts are.
+#ifdef INSO_HT_DEBUG
 	#include <stdio.h>
 	#define INSO_HT_DBG(fmt, ...) printf(fmt, ##__VA_ARGS__);
 #else
@@ -148,7 +150,9 @@ void* inso_ht_get(inso_ht* ht, size_t hash, inso_ht_cmp_fn cmp, void* param){
 bool inso_ht_del(inso_ht* ht, size_t hash, inso_ht_cmp_fn cmp, void* param){
 	assert(ht);
 	assert(ht->memory);
-	inso_ht_tick(ht);
+
+	// holes can't be patched up in prev_memory, so get everything out of it first
+	while(inso_ht_tick(ht));
 
 	size_t index;
 	if(inso_htpriv_get_i(ht, &index, hash, cmp, param)){
@@ -240,15 +244,19 @@ static inline bool inso_htpriv_get_i(inso_ht* ht, intptr_t* idx, size_t hash, in
 static inline void inso_htpriv_del_i(inso_ht* ht, intptr_t idx){
 
 	if(idx < 0){
-		memset(ht->prev_memory - (idx+1), 0, ht->elem_size);
+		memset(ht->prev_memory + -(idx+1) * ht->elem_size, 0, ht->elem_size);
 		return;
 	}
 
 	memset(ht->memory + idx * ht->elem_size, 0, ht->elem_size);
+	ht->used--;
 	INSO_HT_DBG("ht_del: starting. idx=%zu, cap=%zu\n", idx, ht->capacity);
 
+	// i carries on from where it was when the hole moves, it mustn't skip ahead with idx
+	size_t i = idx;
+
 	for(size_t count = 1; count < ht->capacity; ++count){
-		size_t i  = (idx + count) % ht->capacity;
+		i = (i + 1) & (ht->capacity-1);
 		void* ptr = ht->memory + i * ht->elem_size;
 
 		if(inso_htpriv_empty(ht, ptr)){
@@ -261,14 +269,15 @@ static inline void inso_htpriv_del_i(inso_ht* ht, intptr_t idx){
 
 		INSO_HT_DBG("hash=%zu, idx2=%zu, ", hash, idx2);
 
-		if(idx2 <= (size_t)idx){
+		// the element at i can fill the hole unless its home slot is (cyclically) after the hole
+		bool move = i > (size_t)idx
+			? (idx2 <= (size_t)idx || idx2 > i)
+			: (idx2 <= (size_t)idx && idx2 > i);
+
+		if(move){
 			INSO_HT_DBG("swapping.");
-			memcpy(
-				ht->memory + idx  * ht->elem_size,
-				ht->memory + idx2 * ht->elem_size,
-				ht->elem_size
-			);
-			memset(ht->memory + idx2 * ht->elem_size, 0, ht->elem_size);
+			memcpy(ht->memory + idx * ht->elem_size, ptr, ht->elem_size);
+			memset(ptr, 0, ht->elem_size);
 			idx = i;
 		}
 		INSO_HT_DBG("\n");
@@ -6,8 +6,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
 #include "morpheus.h"
 
+// how much output can back up behind a slow reader before lines get dropped
+#define IRC_OUT_MAX (256 * 1024)
+
 static bool irc_parse(char* buf, struct irc_msg* msg){
 
 	// tags
@@ -76,7 +80,8 @@ static bool irc_parse(char* buf, struct irc_msg* msg){
 	}
 }
 
-void irc_recv(struct client* client, const char* buf, size_t len){
+// returns false if the client was dropped
+bool irc_recv(struct client* client, const char* buf, size_t len){
 
 	memcpy(sb_add(client->irc_buf, len), buf, len);
 
@@ -84,10 +89,21 @@ void irc_recv(struct client* client, const char* buf, size_t len){
 	while((p = memchr(client->irc_buf, '\n', sb_count(client->irc_buf)))){
 		*p = '\0';
 
+		// the rest of morpheus (and the homeserver) only deals in UTF-8
+		char* line = client->irc_buf;
+		size_t line_len = p - line;
+		sb(char) fixed = NULL;
+
+		if(cvt_utf8_valid(line, line_len) != line_len){
+			fixed = cvt_charset_fix(client_iconv(client), line, line_len);
+			line = fixed;
+		}
+
 		struct irc_msg msg = {};
-		if(irc_parse(client->irc_buf, &msg)){
+		if(irc_parse(line, &msg)){
 			irc_event(client, &msg);
 		}
+		sb_free(fixed);
 
 		size_t rem = sb_count(client->irc_buf) - ((p+1) - client->irc_buf);
 		memmove(client->irc_buf, p+1, rem);
@@ -96,15 +112,31 @@ void irc_recv(struct client* client, const char* buf, size_t len){
 
 	if(sb_count(client->irc_buf) > 1024){
 		client_del(client);
+		return false;
 	}
+
+	return true;
 }
 
-int irc_send(struct client* client, struct irc_msg* _msg){
-	char buf[1024] = "";
+// formats msg into buf with its CRLF, returning the length or < 0 if it doesn't fit.
+// client can be NULL for lines that are stored to be sent later, see session_send.
+int irc_format(struct client* client, struct irc_msg* _msg, char buf[static 1024]){
 	char* p = buf;
 	int result = 0;
 	struct irc_msg msg = *_msg;
 
+	if(msg.flags & SF_NUMERIC){
+		if(msg.pcount >= countof(msg.params)) return -2;
+		memmove(msg.params + 1, msg.params, msg.pcount * sizeof(*msg.params));
+		msg.params[0] = (client && client->irc_nick) ? client->irc_nick : "*";
+		msg.pcount++;
+	}
+
+	// server-time is the only tag we send
+	if(client && !(client->irc_caps & IRC_CAP_SERVER_TIME)){
+		msg.tags = NULL;
+	}
+
 	// TODO: this stuff is messy... think of a better way
 	char* cvt_prefix = NULL;
 	if(msg.flags & SF_CVT_PREFIX){
@@ -154,62 +186,343 @@ int irc_send(struct client* client, struct irc_msg* _msg){
 	*p++ = '\r';
 	*p++ = '\n';
 
-	// TODO: if msg is too big, send multiple packets
-
-	if(send(client->irc_sock, buf, p - buf, 0) == -1){
-		perror("send");
-		result = -3;
-	}
+	result = p - buf;
 
 out:
-	free(cvt_prefix);
 	return result;
 }
 
-void irc_send_names(struct client* client, struct room* room){
-	sb(char) buf = NULL;
+int irc_send(struct client* client, struct irc_msg* msg){
+	char buf[1024];
 
-	if(!room || !room->canon) return;
+	int len = irc_format(client, msg, buf);
+	if(len < 0) return len;
 
-	// TODO: we need to put user prefixes in here, using member->power
-	//       100+ = OP (@), 50+ = HOP (%)
+	return irc_send_raw(client, buf, len);
+}
 
-	// We also need to either do msg splitting here, or let irc_send take care of that
+// Splitting PRIVMSG / NOTICE text that won't fit in one line. It's broken at newlines
+// first, then at the byte budget left over by the prefix, command and target (worked
+// out once per message). Cuts don't land inside a UTF-8 sequence or a colour code,
+// and any formatting still active at a cut is started again on the next line.
 
-	char* room_name = NULL;
-	room_get_irc_info(room, client, &room_name);
+enum {
+	SPLIT_BOLD    = (1 << 0),
+	SPLIT_ITALIC  = (1 << 1),
+	SPLIT_ULINE   = (1 << 2),
+	SPLIT_REVERSE = (1 << 3),
+};
+
+// the longest formatting restart: 4 toggles and \003NN,NN
+#define SPLIT_FMT_MAX 10
+
+// nick_len is the longest nick the lines will be sent to, which SF_NUMERIC puts in front.
+bool irc_split_init(struct irc_split* s, struct irc_msg* msg, size_t nick_len){
+	memset(s, 0, sizeof(*s));
+
+	if(!msg->pcount || (strcmp(msg->cmd, "PRIVMSG") != 0 && strcmp(msg->cmd, "NOTICE") != 0)){
+		return false;
+	}
+
+	const char* text = msg->params[msg->pcount-1];
+	size_t text_len = strlen(text);
+
+	char* cvt_prefix = NULL;
+	const char* prefix = msg->prefix ?: "morpheus";
+	if(msg->flags & SF_CVT_PREFIX){
+		prefix = cvt_prefix = cvt_m2i_user(id_intern(msg->prefix));
+	}
+
+	// ":prefix CMD param... :" and CRLF
+	size_t overhead = strlen(prefix) + strlen(msg->cmd) + 5;
+	for(size_t i = 0; i < msg->pcount - 1; ++i){
+		overhead += strlen(msg->params[i]) + 1;
+	}
+	if(msg->flags & SF_NUMERIC){
+		overhead += nick_len + 1;
+	}
 
-	sb_each(m, room->members){
-		char prefix = 0;
+	if(overhead + text_len <= 512 && !memchr(text, '\n', text_len)){
+		return false;
+	}
+
+	s->p   = text;
+	s->end = text + text_len;
+	s->budget = overhead + SPLIT_FMT_MAX + 32 < 512 ? 512 - overhead - SPLIT_FMT_MAX : 32;
+
+	if(text_len > 9 && strncmp(text, "\001ACTION ", 8) == 0 && s->end[-1] == '\001'){
+		s->ctcp = true;
+		s->p   += 8;
+		s->end -= 1;
+		s->budget = s->budget > 9 + 32 ? s->budget - 9 : 32;
+	}
 
-		if(m->power == 100){
-			prefix = '@';
-		} else if(m->power >= 50){
-			prefix = '%';
+	return true;
+}
+
+static void irc_split_track(struct irc_split* s, const char* p, const char* end){
+	for(; p < end; ++p){
+		switch(*p){
+			case 0x02: s->fmt ^= SPLIT_BOLD;    break;
+			case 0x1d: s->fmt ^= SPLIT_ITALIC;  break;
+			case 0x1f: s->fmt ^= SPLIT_ULINE;   break;
+			case 0x16: s->fmt ^= SPLIT_REVERSE; break;
+			case 0x0f: s->fmt = 0; s->color[0] = '\0'; break;
+			case 0x03: {
+				// \003 on its own ends the colour, otherwise fg[,bg]
+				size_t n = 0;
+				while(n < 2 && p + 1 + n < end && ISDIGIT(p[1+n])) ++n;
+				if(n && p + 2 + n < end && p[1+n] == ',' && ISDIGIT(p[2+n])){
+					n += 2 + (p + 3 + n < end && ISDIGIT(p[3+n]));
+				}
+				memcpy(s->color, p + 1, n);
+				s->color[n] = '\0';
+				p += n;
+			} break;
 		}
+	}
+}
 
-		const char* c = id_lookup(m->id)+1;
-		const char* end = strchrnul(c, ':');
-		size_t name_len = end - c;
+// the next line's worth of text, or NULL when there's nothing left.
+const char* irc_split_next(struct irc_split* s){
+	while(s->p < s->end){
+		const char* nl = memchr(s->p, '\n', s->end - s->p) ?: s->end;
+		if(nl == s->p){
+			++s->p; // nothing to say on an empty line
+			continue;
+		}
 
-		// TODO: better sizing
-		if(sb_count(buf) + (name_len+2) > 400){
-			sb_push(buf, 0);
-			IRC_SEND_NUM(client, "353", "=", room_name, buf);
-			stb__sbn(buf) = 0;
+		size_t len = nl - s->p;
+		if(len > s->budget){
+			len = s->budget;
+
+			while(len > 0 && ((uint8_t)s->p[len] & 0xC0) == 0x80) --len;
+
+			// don't separate a colour code from its digits
+			for(size_t i = 1; i <= 5 && i <= len; ++i){
+				if(s->p[len - i] == 0x03){
+					len -= i;
+					break;
+				}
+			}
+
+			// a space near the end is a nicer place to break
+			const char* space = memrchr(s->p, ' ', len);
+			if(space && (size_t)(space - s->p) > (s->budget * 3) / 4){
+				len = space - s->p + 1;
+			}
+
+			// nowhere better, but still not in the middle of a character
+			if(len == 0){
+				len = s->budget;
+				while(len > 1 && ((uint8_t)s->p[len] & 0xC0) == 0x80) --len;
+			}
 		}
 
-		if(prefix){
-			sb_push(buf, prefix);
+		char* out = s->line;
+		if(s->ctcp) out = stpcpy(out, "\001ACTION ");
+
+		if(s->fmt & SPLIT_BOLD)    *out++ = 0x02;
+		if(s->fmt & SPLIT_ITALIC)  *out++ = 0x1d;
+		if(s->fmt & SPLIT_ULINE)   *out++ = 0x1f;
+		if(s->fmt & SPLIT_REVERSE) *out++ = 0x16;
+		if(*s->color){
+			*out++ = 0x03;
+			out = stpcpy(out, s->color);
+		}
+
+		memcpy(out, s->p, len);
+		out += len;
+
+		if(s->ctcp) *out++ = '\001';
+		*out = '\0';
+
+		irc_split_track(s, s->p, s->p + len);
+
+		s->p += len;
+		if(s->p == nl && nl < s->end) ++s->p;
+
+		return s->line;
+	}
+
+	return NULL;
+}
+
+// sends an already formatted line, including its CRLF.
+// the socket is non-blocking: whatever it won't take now is queued behind anything
+// already waiting and sent from client_flush when epoll says there's room.
+int irc_send_raw(struct client* client, const char* buf, size_t len){
+	ssize_t n = 0;
+
+	if(sb_count(client->irc_out) == 0){
+		n = send(client->irc_sock, buf, len, 0);
+		if(n == -1){
+			if(errno != EAGAIN && errno != EWOULDBLOCK){
+				perror("send");
+				return -3;
+			}
+			n = 0;
+		}
+		if((size_t)n == len){
+			return 0;
+		}
+	}
+
+	if(sb_count(client->irc_out) + (len - n) > IRC_OUT_MAX){
+		printf("[%02d] output queue full, dropping a line.\n", client->irc_sock);
+		return -3;
+	}
+
+	bool was_empty = sb_count(client->irc_out) == 0;
+	memcpy(sb_add(client->irc_out, len - n), buf + n, len - n);
+	if(was_empty){
+		client_epollout(client, client->irc_list);
+	}
+
+	return 0;
+}
+
+void irc_send_welcome(struct client* client){
+	const char* dev = client->session->mtx_device;
+
+	IRC_SEND_NUM(client, "001", "Welcome to IRC");
+	IRC_SEND_NUM(client, "002", "Your device_id is", dev ?: "unknown");
+	IRC_SEND_NUM(client, "003", "This server was created at some point");
+	IRC_SEND_NUM(client, "004", "morpheus 1.0 ¯\\_(ツ)_/¯");
+	IRC_SEND_NUM(client, "005", "PREFIX=(ohv)@%+ CHANTYPES=#!+ ELIST=MU SAFELIST", "are supported by this server");
+}
+
+// show the IRC client a room that we're already in on the matrix side (see IRC_CAP_LAZY_ATTACH)
+bool irc_attach_room(struct client* client, struct room* room){
+	struct session* sess = client->session;
+
+	struct member* self = room_member_get(room, sess->mtx_id);
+	if(!self || self->state != MEMBER_STATE_JOINED) return false;
+
+	if(client_in_room(client, room->id)) return true;
+
+	char* room_name = NULL;
+	if(room_get_irc_info(room, sess, &room_name) <= ROOM_IRC_QUERY){
+		return false;
+	}
+
+	client_room_add(client, room);
+
+	IRC_SEND_PF(client, id_lookup(sess->mtx_id), SF_CVT_PREFIX, "JOIN", room_name);
+	irc_send_topic(client, room);
+	irc_send_names(client, room);
+
+	return true;
+}
+
+void irc_send_names(struct client* client, struct room* room){
+	if(!room) return;
+
+	// 366 has to be sent whatever happens, or the client waits for it forever
+	char* room_name = NULL;
+	if(room_get_irc_info(room, client->session, &room_name) <= ROOM_IRC_QUERY || !room_name){
+		IRC_SEND_NUM(client, "366", room_name ?: id_lookup(room->id), "End of /NAMES list.");
+		return;
+	}
+
+	sb(char)* lines = room_names_lines(room);
+	bool self_listed = !room->names_large;
+
+	sb_each(l, lines){
+		if(sb_count(*l) > 1){
+			IRC_SEND_NUM(client, "353", "=", room_name, *l);
+		}
+	}
+
+	// large rooms only list ops and recent speakers, but we should always see ourselves
+	struct member* self = room_member_get(room, client->session->mtx_id);
+	if(self && !self_listed && !room_member_prefix(room, self->power)){
+		sb_each(a, room->active){
+			if(*a == self->id) self_listed = true;
+		}
+		if(!self_listed){
+			IRC_SEND_NUM(client, "353", "=", room_name, client->irc_nick);
 		}
-		memcpy(sb_add(buf, name_len), c, name_len);
-		sb_push(buf, ' ');
 	}
-	sb_push(buf, 0);
 
-	IRC_SEND_NUM(client, "353", "=", room_name, buf);
 	IRC_SEND_NUM(client, "366", room_name, "End of /NAMES list.");
+}
+
+void irc_send_topic(struct client* client, struct room* room){
+	if(!room->topic) return;
+
+	char* room_name = NULL;
+	room_get_irc_info(room, client->session, &room_name);
+
+	char epoch_str[32] = "";
+	snprintf(epoch_str, sizeof(epoch_str), "%zu", (size_t)room->topic_time);
+
+	char* hostmask = cvt_m2i_user(room->topic_setter);
+
+	IRC_SEND_NUM(client, "332", room_name, room->topic);
+	IRC_SEND_NUM(client, "333", room_name, hostmask, epoch_str);
+}
+
+void irc_send_whois(struct client* client, mtx_id user){
+	char* hostmask = cvt_m2i_user(user);
+	char* nick = strdupa(hostmask);
+	*strchrnul(nick, '!') = '\0';
+
+	char* ident = strchr(hostmask, '!') + 1;
+	char* host  = strchr(ident, '@');
+	*host++ = '\0';
+
+	const char* display_name = NULL;
+	const char* avatar_url = NULL;
+	profile_get(user, &display_name, &avatar_url);
+
+	IRC_SEND_NUM(client, "311", nick, ident, host, "*", display_name ?: nick);
+
+	// only the channels this client can see
+	sb(char) chans = NULL;
+	size_t nrooms;
+	const mtx_id* rooms = room_user_rooms(user, &nrooms);
+
+	for(size_t i = 0; i < nrooms; ++i){
+		if(!client_in_room(client, rooms[i])) continue;
+
+		struct room* room = room_lookup_mtx(rooms[i]);
+		if(!room) continue;
+
+		struct member* m = room_member_get(room, user);
+		if(!m || m->state != MEMBER_STATE_JOINED) continue;
+
+		char* room_name = NULL;
+		if(room_get_irc_info(room, client->session, &room_name) == ROOM_IRC_CHANNEL){
+			if(sb_count(chans) + strlen(room_name) + 2 > 400){
+				sb_push(chans, 0);
+				IRC_SEND_NUM(client, "319", nick, chans);
+				stb__sbn(chans) = 0;
+			}
+			char prefix = room_member_prefix(room, m->power);
+			if(prefix){
+				sb_push(chans, prefix);
+			}
+			memcpy(sb_add(chans, strlen(room_name)), room_name, strlen(room_name));
+			sb_push(chans, ' ');
+		}
+	}
+	if(chans){
+		sb_push(chans, 0);
+		IRC_SEND_NUM(client, "319", nick, chans);
+		sb_free(chans);
+	}
+
+	IRC_SEND_NUM(client, "312", nick, host, "Matrix homeserver");
+
+	const char* away = presence_away(user);
+	if(away){
+		IRC_SEND_NUM(client, "301", nick, away);
+	}
+
+	if(avatar_url){
+		IRC_SEND_NUM(client, "320", nick, avatar_url);
+	}
 
-	free(room_name);
-	sb_free(buf);
+	IRC_SEND_NUM(client, "318", nick, "End of /WHOIS list.");
 }
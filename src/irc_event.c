@@ -3,7 +3,7 @@
 static void irc_event_ping(struct client* client, struct irc_msg* msg){
 	char buf[256];
 	int len = snprintf(buf, sizeof(buf), ":morpheus PONG :%s\r\n", msg->params[0] ?: "");
-	send(client->irc_sock, buf, len, 0);
+	irc_send_raw(client, buf, MIN(len, (int)sizeof(buf) - 1));
 }
 
 static void irc_event_pong(struct client* client, struct irc_msg* msg){
@@ -16,7 +16,7 @@ static void irc_event_privmsg(struct client* client, struct irc_msg* msg){
 	if(msg->params[0][0] == '#' || msg->params[0][0] == '!'){ // PRIVMSG to channel
 
 		if((room = room_lookup_irc(msg->params[0]))){
-			mtx_send_msg(client, room, msg->params[1]);
+			mtx_send_msg(client->session, client, room, msg->params[1]);
 		} else {
 			// TODO: it might exist, but we're not in it.. should we check?
 			IRC_SEND_NUM(client, "401", msg->params[0], "No such nick/channel.");
@@ -26,11 +26,11 @@ static void irc_event_privmsg(struct client* client, struct irc_msg* msg){
 
 		mtx_id user = cvt_i2m_user(msg->params[0]);
 
-		if((room = room_find_query(client, user))){
-			mtx_send_msg(client, room, msg->params[1]);
+		// rooms that aren't in m.direct still count if they look like a query
+		if((room = direct_room(client->session, user)) || (room = room_find_query(client->session, user))){
+			mtx_send_msg(client->session, client, room, msg->params[1]);
 		} else {
-			mtx_send_pm_setup(client, user, msg->params[1]);
-			// upon creating room, send NOTICE from user stating room was created
+			mtx_send_pm(client->session, user, msg->params[1]);
 		}
 
 	}
@@ -38,17 +38,28 @@ static void irc_event_privmsg(struct client* client, struct irc_msg* msg){
 
 static void irc_event_join(struct client* client, struct irc_msg* msg){
 	char* state;
-	for(char* c = strtok_r((char*)msg->params[0], ",", &state); c; c = strtok_r(NULL, ",", &state)){
-		mtx_send_join(client, msg->params[0]);
+	char* list = strdupa(msg->params[0]);
+
+	// each one is answered as it completes, see MTX_MSG_JOIN and MTX_MSG_STATE
+	for(char* c = strtok_r(list, ",", &state); c; c = strtok_r(NULL, ",", &state)){
+		struct room* room = room_lookup_irc(c);
+		if(room && irc_attach_room(client, room)) continue;
+
+		mtx_send_join(client->session, client, c);
 	}
 }
 
 static void irc_event_part(struct client* client, struct irc_msg* msg){
-	struct room* room = room_lookup_irc(msg->params[0]);
-	if(room){
-		mtx_send_leave(client, room);
-	} else {
-		IRC_SEND_NUM(client, "403", msg->params[0], "No such channel.");
+	char* state;
+	char* list = strdupa(msg->params[0]);
+
+	for(char* c = strtok_r(list, ",", &state); c; c = strtok_r(NULL, ",", &state)){
+		struct room* room = room_lookup_irc(c);
+		if(room){
+			mtx_send_leave(client->session, client, room);
+		} else {
+			IRC_SEND_NUM(client, "403", c, "No such channel.");
+		}
 	}
 }
 
@@ -57,15 +68,49 @@ static void irc_event_topic(struct client* client, struct irc_msg* msg){
 	
 	// TODO: handle showing / removal of topic?
 	if(room){
-		mtx_send_topic(client, room, msg->params[1]);
+		mtx_send_topic(client->session, room, msg->params[1]);
 	} else {
 		IRC_SEND_NUM(client, "403", msg->params[0], "No such channel.");
 	}
 }
 
+static void irc_event_list(struct client* client, struct irc_msg* msg){
+	// LIST with a server target isn't meaningful here, only the ELIST conditions are used.
+	directory_list(client, msg->pcount ? msg->params[0] : NULL);
+}
+
+static void irc_event_names(struct client* client, struct irc_msg* msg){
+	if(msg->pcount == 0){
+		IRC_SEND_NUM(client, "366", "*", "End of /NAMES list.");
+		return;
+	}
+
+	char* state;
+	char* list = strdupa(msg->params[0]);
+
+	for(char* c = strtok_r(list, ",", &state); c; c = strtok_r(NULL, ",", &state)){
+		struct room* room = room_lookup_irc(c);
+
+		if(!room){
+			IRC_SEND_NUM(client, "366", c, "End of /NAMES list.");
+		} else if(room_members_loaded(room) || !client_in_room(client, room->id)){
+			irc_send_names(client, room);
+		} else {
+			// the reply is sent once they've arrived, see MTX_MSG_MEMBERS
+			mtx_send_members(client->session, room, client);
+		}
+	}
+}
+
 static void irc_event_mode(struct client* client, struct irc_msg* msg){
 	struct room* room = room_lookup_irc(msg->params[0]);
 
+	// clients tend to ask for this right after joining, so use it as a cue to fill
+	// in the rest of the nick list that lazy-loading left out.
+	if(room && !room_members_loaded(room) && client_in_room(client, room->id)){
+		mtx_send_members(client->session, room, client);
+	}
+
 	if(room && msg->pcount == 1){
 		// TODO: use the other func to check?
 		if(msg->params[0][0] == '#' || msg->params[0][0] == '&'){
@@ -80,6 +125,78 @@ static void irc_event_mode(struct client* client, struct irc_msg* msg){
 	}
 }
 
+static void irc_send_who_line(struct client* client, const char* chan, struct room* room, struct member* m){
+	char* hostmask = cvt_m2i_user(m->id);
+	char* nick  = hostmask;
+	char* ident = strchr(nick, '!');
+	*ident++ = '\0';
+	char* host  = strchr(ident, '@');
+	*host++ = '\0';
+
+	const char* display_name = NULL;
+	profile_get(m->id, &display_name, NULL);
+
+	char flags[3] = { presence_away(m->id) ? 'G' : 'H', room ? room_member_prefix(room, m->power) : 0 };
+
+	char* real = scratch_printf("0 %s", display_name ?: nick);
+	IRC_SEND_NUM(client, "352", chan, ident, host, host, nick, flags, real);
+}
+
+// answered from what we already know, a WHO on a big room shouldn't mean a request per member.
+static void irc_event_who(struct client* client, struct irc_msg* msg){
+	const char* mask = msg->pcount ? msg->params[0] : "*";
+
+	if(*mask == '#' || *mask == '!'){
+		struct room* room = room_lookup_irc(mask);
+
+		if(room && client_in_room(client, room->id)){
+			sb_each(m, room->members){
+				if(m->state == MEMBER_STATE_JOINED){
+					irc_send_who_line(client, mask, room, m);
+				}
+			}
+
+			// the rest will be there for next time
+			if(!room_members_loaded(room)){
+				mtx_send_members(client->session, room, NULL);
+			}
+		}
+	} else if(strcmp(mask, "*") != 0 && !strpbrk(mask, "*?")){
+		struct member m = { .id = cvt_i2m_user(mask) };
+
+		if(profile_get(m.id, NULL, NULL)){
+			irc_send_who_line(client, "*", NULL, &m);
+		} else {
+			profile_fetch(NULL, m.id);
+		}
+	}
+
+	IRC_SEND_NUM(client, "315", mask, "End of /WHO list.");
+}
+
+static void irc_event_whois(struct client* client, struct irc_msg* msg){
+	// WHOIS [server] nick
+	const char* nick = msg->params[msg->pcount - 1];
+	mtx_id user = cvt_i2m_user(nick);
+
+	if(profile_get(user, NULL, NULL)){
+		irc_send_whois(client, user);
+	} else {
+		profile_fetch(client, user);
+	}
+}
+
+// not a standard command, it picks the charset for anything we get that isn't UTF-8.
+static void irc_event_charset(struct client* client, struct irc_msg* msg){
+	client_set_charset(client, msg->params[0]);
+
+	if(client_iconv(client) == (iconv_t)-1){
+		IRC_SEND_NUM(client, "NOTICE", "Unknown charset, invalid UTF-8 will be replaced");
+	} else {
+		IRC_SEND_NUM(client, "NOTICE", "Charset set");
+	}
+}
+
 static void irc_event_nick(struct client* client, struct irc_msg* msg){
 	// TODO: check other nicks, see if it is available or not
 	//       handle changing nick with matrix?
@@ -103,7 +220,7 @@ static void irc_event_cap(struct client* client, struct irc_msg* msg){
 
 		struct irc_msg m = {
 			.cmd = "CAP",
-			.params  = { client->irc_nick ?: "*", "LS", "server-time away-notify" },
+			.params  = { client->irc_nick ?: "*", "LS", "server-time away-notify morpheus/lazy-attach" },
 			.pcount  = 3,
 		};
 		irc_send(client, &m);
@@ -116,6 +233,7 @@ static void irc_event_cap(struct client* client, struct irc_msg* msg){
 
 		if(client->irc_caps & IRC_CAP_SERVER_TIME) p = stpcpy(p, "server-time ");
 		if(client->irc_caps & IRC_CAP_AWAY_NOTIFY) p = stpcpy(p, "away-notify ");
+		if(client->irc_caps & IRC_CAP_LAZY_ATTACH) p = stpcpy(p, "morpheus/lazy-attach ");
 
 		struct irc_msg m = {
 			.cmd = "CAP",
@@ -135,6 +253,8 @@ static void irc_event_cap(struct client* client, struct irc_msg* msg){
 				client->irc_caps |= IRC_CAP_SERVER_TIME;
 			} else if(strcmp(cap, "away-notify") == 0){
 				client->irc_caps |= IRC_CAP_AWAY_NOTIFY;
+			} else if(strcmp(cap, "morpheus/lazy-attach") == 0){
+				client->irc_caps |= IRC_CAP_LAZY_ATTACH;
 			}
 		}
 
@@ -145,6 +265,7 @@ static void irc_event_cap(struct client* client, struct irc_msg* msg){
 		if(cap_diff){
 			if(cap_diff & IRC_CAP_SERVER_TIME) p = stpcpy(p, "server-time ");
 			if(cap_diff & IRC_CAP_AWAY_NOTIFY) p = stpcpy(p, "away-notify ");
+			if(cap_diff & IRC_CAP_LAZY_ATTACH) p = stpcpy(p, "morpheus/lazy-attach ");
 			struct irc_msg m = {
 				.cmd = "CAP",
 				.params  = { client->irc_nick ?: "*", "ACK", caps },
@@ -179,6 +300,8 @@ static void irc_event_cap(struct client* client, struct irc_msg* msg){
 
 typedef void event_fn(struct client* client, struct irc_msg*);
 
+static void irc_event_stats(struct client* client, struct irc_msg* msg);
+
 enum {
 	SF_NEED_REG   = (1 << 0),
 	SF_NEED_UNREG = (1 << 1),
@@ -197,44 +320,80 @@ static struct irc_handler {
 	{ "PART"    , 1, SF_NEED_REG  , &irc_event_part },
 	{ "TOPIC"   , 1, SF_NEED_REG  , &irc_event_topic },
 	{ "MODE"    , 1, SF_NEED_REG  , &irc_event_mode },
+	{ "NAMES"   , 0, SF_NEED_REG  , &irc_event_names },
+	{ "LIST"    , 0, SF_NEED_REG  , &irc_event_list },
+	{ "WHO"     , 0, SF_NEED_REG  , &irc_event_who },
+	{ "WHOIS"   , 1, SF_NEED_REG  , &irc_event_whois },
 	{ "NICK"    , 1, 0            , &irc_event_nick },
 	{ "USER"    , 3, SF_NEED_UNREG, &irc_event_user },
 	{ "PASS"    , 1, SF_NEED_UNREG, &irc_event_pass },
 	{ "CAP"     , 1, 0            , &irc_event_cap },
+	{ "CHARSET" , 1, 0            , &irc_event_charset },
+	{ "STATS"   , 0, SF_NEED_REG  , &irc_event_stats },
 };
 
-void irc_event(struct client* client, struct irc_msg* msg){
-	bool found = false;
+static struct phash irc_handler_hash;
+static struct handler_stats irc_handler_stats[countof(irc_handlers)];
 
-	for(size_t i = 0; i < countof(irc_handlers); ++i){
-		struct irc_handler* h = irc_handlers + i;
+static void irc_send_stats_line(struct client* client, const char* name, const struct handler_stats* s){
+	if(!s->calls) return;
 
-		if(strcasecmp(msg->cmd, h->event) == 0){
-			found = true;
+	char buf[256];
+	snprintf(buf, sizeof(buf), "%s: %llu calls, %.3f ms cpu, %.1f us avg",
+	         name, (unsigned long long)s->calls, s->cpu_ns / 1e6, (s->cpu_ns / 1e3) / s->calls);
+	IRC_SEND_NUM(client, "249", buf);
+}
 
-			if(msg->pcount < h->min_params){
-				IRC_SEND_NUM(client, "461", msg->cmd, "Not enough parameters");
-			} else if((h->state_flags & SF_NEED_REG) && !(client->irc_state & IRC_STATE_REGISTERED)){
-				IRC_SEND_NUM(client, "451", "You have not registered");
-			} else if((h->state_flags & SF_NEED_UNREG) && (client->irc_state & IRC_STATE_REGISTERED)){
-				IRC_SEND_NUM(client, "462", "Unauthorized command (already registered)");
-			} else {
-				client->irc_state &= ~IRC_STATE_IDLE;
-				client->last_cmd_time = time(0);
+// not the standard STATS queries, just how much time each handler has taken.
+static void irc_event_stats(struct client* client, struct irc_msg* msg){
+	for(size_t i = 0; i < countof(irc_handlers); ++i){
+		irc_send_stats_line(client, irc_handlers[i].event, irc_handler_stats + i);
+	}
 
-				printf("[%02d] IRC cmd [%s]\n", client->irc_sock, msg->cmd);
+	const struct handler_stats* s;
+	const char* name;
+	for(size_t i = 0; (s = mtx_event_stats(i, &name)); ++i){
+		irc_send_stats_line(client, name, s);
+	}
 
-				h->func(client, msg);
+	IRC_SEND_NUM(client, "219", msg->pcount ? msg->params[0] : "*", "End of /STATS report");
+}
 
-				if(!(client->irc_state & (IRC_STATE_REGISTERED | IRC_STATE_REG_SUSPEND)) && client->irc_user && client->irc_nick && client->irc_pass){
-					mtx_send_login(client);
-				}
-			}
-			break;
-		}
+void irc_event(struct client* client, struct irc_msg* msg){
+	if(!irc_handler_hash.slots){
+		phash_init(&irc_handler_hash, &irc_handlers[0].event, sizeof(*irc_handlers), countof(irc_handlers), true);
 	}
 
-	if(!found){
+	int index = phash_find(&irc_handler_hash, msg->cmd);
+	if(index == -1){
 		IRC_SEND_NUM(client, "421", msg->cmd, "Unknown command");
+		return;
+	}
+
+	struct irc_handler* h = irc_handlers + index;
+
+	if(msg->pcount < h->min_params){
+		IRC_SEND_NUM(client, "461", msg->cmd, "Not enough parameters");
+	} else if((h->state_flags & SF_NEED_REG) && !(client->irc_state & IRC_STATE_REGISTERED)){
+		IRC_SEND_NUM(client, "451", "You have not registered");
+	} else if((h->state_flags & SF_NEED_UNREG) && (client->irc_state & IRC_STATE_REGISTERED)){
+		IRC_SEND_NUM(client, "462", "Unauthorized command (already registered)");
+	} else {
+		client->irc_state &= ~IRC_STATE_IDLE;
+		client->last_cmd_time = time(0);
+
+		printf("[%02d] IRC cmd [%s]\n", client->irc_sock, msg->cmd);
+
+		struct scratch_pos scratch = scratch_save();
+		uint64_t start = cpu_ns();
+		h->func(client, msg);
+
+		irc_handler_stats[index].calls++;
+		irc_handler_stats[index].cpu_ns += cpu_ns() - start;
+
+		if(!(client->irc_state & (IRC_STATE_REGISTERED | IRC_STATE_REG_SUSPEND)) && !client->session && client->irc_user && client->irc_nick && client->irc_pass){
+			session_login(client);
+		}
+		scratch_restore(scratch);
 	}
 }
@@ -0,0 +1,442 @@
+#include <errno.h>
+#include <stdio.h>
+#include "morpheus.h"
+
+// A JSON DOM for the homeserver's responses. Everything, including the tree of
+// nodes and the child arrays, goes in one bump arena that is thrown away in one
+// go by json_free. Strings aren't copied: they're NUL terminated where they sit in
+// the buffer being parsed, and only unescaped (again in place) if json_str is
+// ever called on them. Most of the strings in a sync are never looked at.
+
+#define JSON_MAX_DEPTH 256
+#define JSON_ALIGN     8
+
+// blocks double in size up to this, then stay at it, so a big sync doesn't end
+// up with a last block that's mostly empty.
+#define JSON_BLOCK_MAX (1024 * 1024)
+
+struct json_block {
+	struct json_block* next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+// root must be first, json_free finds the rest of the document from it
+struct json_doc {
+	struct json_node   root;
+	struct json_block* blocks;
+};
+
+struct json_parser {
+	char* p;
+	char* end;
+	struct json_block* blocks;
+	int depth;
+};
+
+// children of the containers we're in the middle of, they're copied into the
+// arena once we know how many there are.
+static sb(json_val) json_stack_vals;
+static sb(char*)    json_stack_keys;
+
+static void json_block_new(struct json_parser* jp, size_t size){
+	struct json_block* b = malloc(sizeof(*b) + size);
+	b->next = jp->blocks;
+	b->used = 0;
+	b->size = size;
+	jp->blocks = b;
+}
+
+static void* json_alloc(struct json_parser* jp, size_t sz){
+	sz = (sz + JSON_ALIGN - 1) & ~(size_t)(JSON_ALIGN - 1);
+
+	struct json_block* b = jp->blocks;
+
+	// big arrays get a block of their own, behind the current one so that it isn't wasted
+	if(b && sz > JSON_BLOCK_MAX / 4 && b->used + sz > b->size){
+		struct json_block* big = malloc(sizeof(*big) + sz);
+		big->next = b->next;
+		big->used = big->size = sz;
+		b->next = big;
+		return big->data;
+	}
+
+	if(!b || b->used + sz > b->size){
+		size_t size = b ? MIN(b->size * 2, (size_t)JSON_BLOCK_MAX) : 4096;
+		json_block_new(jp, MAX(size, sz));
+		b = jp->blocks;
+	}
+
+	void* mem = b->data + b->used;
+	b->used += sz;
+	return mem;
+}
+
+static void json_blocks_free(struct json_block* b){
+	while(b){
+		struct json_block* next = b->next;
+		free(b);
+		b = next;
+	}
+}
+
+static inline void json_skip_ws(struct json_parser* jp){
+	while(jp->p < jp->end && (*jp->p == ' ' || *jp->p == '\n' || *jp->p == '\r' || *jp->p == '\t')){
+		++jp->p;
+	}
+}
+
+static inline int json_hex(char c){
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+static uint32_t json_hex4(const char* s){
+	uint32_t v = 0;
+	for(int i = 0; i < 4; ++i){
+		v = (v << 4) | json_hex(s[i]);
+	}
+	return v;
+}
+
+// finds the end of the string starting after the opening quote, checking the
+// escapes are well formed. Its closing quote is replaced with a NUL.
+static char* json_scan_string(struct json_parser* jp, bool* escaped){
+	char* start = jp->p;
+	char* p = start;
+
+	*escaped = false;
+
+	for(;;){
+		if(p >= jp->end) return NULL;
+
+		uint8_t c = *p;
+		if(c == '"') break;
+		if(c < 0x20) return NULL;
+
+		if(c == '\\'){
+			if(++p >= jp->end) return NULL;
+			*escaped = true;
+
+			if(*p == 'u'){
+				if(jp->end - p < 5) return NULL;
+				for(int i = 1; i <= 4; ++i){
+					if(json_hex(p[i]) == -1) return NULL;
+				}
+				p += 4;
+			} else if(!*p || !strchr("\"\\/bfnrt", *p)){
+				return NULL;
+			}
+		}
+		++p;
+	}
+
+	*p = '\0';
+	jp->p = p + 1;
+	return start;
+}
+
+// unescapes a string in place, it can only get shorter.
+static void json_unescape(char* str){
+	char* out = str;
+
+	for(char* in = str; *in; /**/){
+		if(*in != '\\'){
+			*out++ = *in++;
+			continue;
+		}
+
+		++in;
+		switch(*in++){
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'u': {
+				uint32_t cp = json_hex4(in);
+				in += 4;
+
+				if(cp >= 0xD800 && cp < 0xDC00 && in[0] == '\\' && in[1] == 'u'){
+					uint32_t lo = json_hex4(in + 2);
+					if(lo >= 0xDC00 && lo < 0xE000){
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+						in += 6;
+					}
+				}
+
+				// lone surrogates, and NULs that would cut the string short
+				if(cp == 0 || (cp >= 0xD800 && cp < 0xE000)){
+					cp = 0xFFFD;
+				}
+
+				if(cp < 0x80){
+					*out++ = cp;
+				} else if(cp < 0x800){
+					*out++ = 0xC0 | (cp >> 6);
+					*out++ = 0x80 | (cp & 0x3F);
+				} else if(cp < 0x10000){
+					*out++ = 0xE0 | (cp >> 12);
+					*out++ = 0x80 | ((cp >> 6) & 0x3F);
+					*out++ = 0x80 | (cp & 0x3F);
+				} else {
+					*out++ = 0xF0 | (cp >> 18);
+					*out++ = 0x80 | ((cp >> 12) & 0x3F);
+					*out++ = 0x80 | ((cp >> 6) & 0x3F);
+					*out++ = 0x80 | (cp & 0x3F);
+				}
+			} break;
+			default: *out++ = in[-1]; break; // " \ /
+		}
+	}
+
+	*out = '\0';
+}
+
+static bool json_parse_value(struct json_parser* jp, json_val v);
+
+static bool json_parse_container(struct json_parser* jp, json_val v, bool object){
+	if(++jp->depth > JSON_MAX_DEPTH) return false;
+
+	size_t base = sb_count(json_stack_vals);
+	char close = object ? '}' : ']';
+
+	++jp->p;
+	json_skip_ws(jp);
+
+	if(jp->p < jp->end && *jp->p == close){
+		++jp->p;
+	} else for(;;){
+		if(object){
+			bool escaped;
+			if(jp->p >= jp->end || *jp->p != '"') return false;
+			++jp->p;
+
+			char* key = json_scan_string(jp, &escaped);
+			if(!key) return false;
+			if(escaped) json_unescape(key);
+			sb_push(json_stack_keys, key);
+
+			json_skip_ws(jp);
+			if(jp->p >= jp->end || *jp->p != ':') return false;
+			++jp->p;
+		}
+
+		json_val child = json_alloc(jp, sizeof(*child));
+		sb_push(json_stack_vals, child);
+		if(!json_parse_value(jp, child)) return false;
+
+		json_skip_ws(jp);
+		if(jp->p >= jp->end) return false;
+
+		if(*jp->p == ','){
+			++jp->p;
+			json_skip_ws(jp);
+		} else if(*jp->p == close){
+			++jp->p;
+			break;
+		} else {
+			return false;
+		}
+	}
+
+	size_t n = sb_count(json_stack_vals) - base;
+	json_val* values = NULL;
+
+	if(n){
+		values = json_alloc(jp, n * sizeof(json_val));
+		memcpy(values, json_stack_vals + base, n * sizeof(json_val));
+		stb__sbn(json_stack_vals) = base;
+	}
+
+	if(object){
+		v->type = JSON_OBJECT;
+		v->u.object.values = values;
+		v->u.object.len = n;
+		v->u.object.keys = NULL;
+
+		if(n){
+			size_t kbase = sb_count(json_stack_keys) - n;
+			v->u.object.keys = json_alloc(jp, n * sizeof(char*));
+			memcpy(v->u.object.keys, json_stack_keys + kbase, n * sizeof(char*));
+			stb__sbn(json_stack_keys) = kbase;
+		}
+	} else {
+		v->type = JSON_ARRAY;
+		v->u.array.values = values;
+		v->u.array.len = n;
+	}
+
+	--jp->depth;
+	return true;
+}
+
+static bool json_parse_number(struct json_parser* jp, json_val v){
+	char* start = jp->p;
+	bool integer = true;
+
+	if(jp->p < jp->end && *jp->p == '-') ++jp->p;
+	if(jp->p >= jp->end || !ISDIGIT(*jp->p)) return false;
+
+	while(jp->p < jp->end){
+		char c = *jp->p;
+		if(c == '.' || c == 'e' || c == 'E'){
+			integer = false;
+		} else if(!ISDIGIT(c) && c != '+' && c != '-'){
+			break;
+		}
+		++jp->p;
+	}
+
+	// the character after the number is never a digit, so strto* stops where we did
+	char* end;
+	v->type = JSON_NUMBER;
+
+	if(integer){
+		errno = 0;
+		v->u.number.i = strtoll(start, &end, 10);
+		v->u.number.d = v->u.number.i;
+		v->flags = errno == ERANGE ? 0 : JSON_F_INTEGER;
+		if(!v->flags) v->u.number.d = strtod(start, &end);
+	} else {
+		v->u.number.d = strtod(start, &end);
+		v->u.number.i = v->u.number.d;
+	}
+
+	return end == jp->p;
+}
+
+static bool json_parse_literal(struct json_parser* jp, json_val v, const char* lit, int type){
+	size_t len = strlen(lit);
+	if((size_t)(jp->end - jp->p) < len || memcmp(jp->p, lit, len) != 0) return false;
+
+	jp->p += len;
+	v->type = type;
+	return true;
+}
+
+static bool json_parse_value(struct json_parser* jp, json_val v){
+	v->flags = 0;
+	json_skip_ws(jp);
+	if(jp->p >= jp->end) return false;
+
+	switch(*jp->p){
+		case '{': return json_parse_container(jp, v, true);
+		case '[': return json_parse_container(jp, v, false);
+		case '"': {
+			bool escaped;
+			++jp->p;
+			v->type = JSON_STRING;
+			v->u.string = json_scan_string(jp, &escaped);
+			if(escaped) v->flags = JSON_F_ESCAPED;
+			return v->u.string;
+		}
+		case 't': return json_parse_literal(jp, v, "true" , JSON_TRUE);
+		case 'f': return json_parse_literal(jp, v, "false", JSON_FALSE);
+		case 'n': return json_parse_literal(jp, v, "null" , JSON_NULL);
+		default:  return json_parse_number(jp, v);
+	}
+}
+
+static json_val json_parse_in(struct json_parser* jp){
+	struct json_doc* doc = json_alloc(jp, sizeof(*doc));
+	memset(doc, 0, sizeof(*doc));
+
+	bool ok = json_parse_value(jp, &doc->root);
+	if(ok){
+		json_skip_ws(jp);
+		ok = jp->p == jp->end;
+	}
+
+	if(json_stack_vals) stb__sbn(json_stack_vals) = 0;
+	if(json_stack_keys) stb__sbn(json_stack_keys) = 0;
+
+	if(!ok){
+		json_blocks_free(jp->blocks);
+		return NULL;
+	}
+
+	doc->blocks = jp->blocks;
+	return &doc->root;
+}
+
+// parses buf[0..len) in place, buf[len] must be a NUL. The strings in the result
+// point into buf, so it has to outlive the tree. Returns NULL if it isn't valid JSON.
+json_val json_parse(char* buf, size_t len){
+	if(!buf) return NULL;
+
+	struct json_parser jp = {
+		.p   = buf,
+		.end = buf + len,
+	};
+
+	// the tree is usually smaller than this, so small bodies only need one malloc
+	json_block_new(&jp, MIN(len * 2 + 256, (size_t)JSON_BLOCK_MAX));
+
+	return json_parse_in(&jp);
+}
+
+// as json_parse, but for when buf is still needed as it was. The copy goes in the arena.
+json_val json_parse_copy(const char* buf, size_t len){
+	if(!buf) return NULL;
+
+	struct json_parser jp = {};
+	json_block_new(&jp, len + 1 + MIN(len * 2 + 256, (size_t)JSON_BLOCK_MAX));
+
+	char* copy = json_alloc(&jp, len + 1);
+	memcpy(copy, buf, len);
+	copy[len] = '\0';
+
+	jp.p   = copy;
+	jp.end = copy + len;
+
+	return json_parse_in(&jp);
+}
+
+// how much of the document's arena is in use, and how much was malloc'd for it.
+void json_arena_size(json_val root, size_t* used, size_t* reserved){
+	*used = *reserved = 0;
+	if(!root) return;
+
+	for(struct json_block* b = container_of(root, struct json_doc, root)->blocks; b; b = b->next){
+		*used     += b->used;
+		*reserved += b->size;
+	}
+}
+
+void json_free(json_val root){
+	if(!root) return;
+	json_blocks_free(container_of(root, struct json_doc, root)->blocks);
+}
+
+const char* json_str(json_val v){
+	if(!v || v->type != JSON_STRING) return NULL;
+
+	if(v->flags & JSON_F_ESCAPED){
+		json_unescape(v->u.string);
+		v->flags &= ~JSON_F_ESCAPED;
+	}
+
+	return v->u.string;
+}
+
+json_val json_get(json_val v, const char** path, int type){
+	for(; v && *path; ++path){
+		if(v->type != JSON_OBJECT) return NULL;
+
+		json_val next = NULL;
+		for(size_t i = 0; i < v->u.object.len; ++i){
+			if(strcmp(v->u.object.keys[i], *path) == 0){
+				next = v->u.object.values[i];
+				break;
+			}
+		}
+		v = next;
+	}
+
+	if(!v || (type != JSON_ANY && v->type != type)) return NULL;
+	return v;
+}
@@ -28,7 +28,7 @@ void epoll_dispatch(struct epoll_event* e){
 			struct sockaddr_storage addr;
 			socklen_t len = sizeof(addr);
 
-			int fd = accept(main_sock, (struct sockaddr*)&addr, &len);
+			int fd = accept4(main_sock, (struct sockaddr*)&addr, &len, SOCK_NONBLOCK);
 
 			if(fd == -1){
 				perror("accept");
@@ -40,19 +40,34 @@ void epoll_dispatch(struct epoll_event* e){
 		case EPOLL_TAG_IRC_CLIENT: {
 			struct client* client = container_of(e->data.ptr, struct client, epoll_irc_tag);
 
-			if(e->events & EPOLLRDHUP){
+			if(e->events & (EPOLLRDHUP | EPOLLERR)){
 				client_del(client);
-			} else if(e->events & EPOLLIN){
+				break;
+			}
+
+			if(e->events & EPOLLIN){
 				char buf[1024];
 				int n = recv(client->irc_sock, buf, sizeof(buf), 0);
-				if(n == -1){
+				if(n == -1 && errno != EAGAIN && errno != EWOULDBLOCK){
 					perror("read");
 					client_del(client);
+					break;
 				} else if(n == 0){
 					client_del(client);
-				} else {
+					break;
+				} else if(n > 0){
 					//printf("client data: %.*s", n, buf);
-					irc_recv(client, buf, n);
+					if(!irc_recv(client, buf, n)) break;
+				}
+			}
+
+			if(e->events & EPOLLOUT){
+				if(!client_flush(client)){
+					client_del(client);
+					break;
+				}
+				if(sb_count(client->irc_out) == 0){
+					directory_list_continue(client);
 				}
 			}
 		} break;
@@ -113,6 +128,20 @@ int main(int argc, char** argv){
 		global.device_name = "Morpheus (https://github.com/baines/morpheus)";
 	}
 
+	global.detach_timeout = 24 * 60 * 60;
+	const char* detach_str = getenv("MTX_DETACH_TIMEOUT");
+	if(detach_str){
+		global.detach_timeout = atoi(detach_str);
+	}
+
+	global.irc_charset = getenv("MTX_IRC_CHARSET") ?: "CP1252";
+
+	global.large_room_members = 1000;
+	const char* large_str = getenv("MTX_LARGE_ROOM_MEMBERS");
+	if(large_str){
+		global.large_room_members = atoi(large_str);
+	}
+
 	global.epoll = epoll_create(16);
 	main_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
@@ -177,6 +206,9 @@ int main(int argc, char** argv){
 
 		for(int i = 0; i < n; ++i){
 			epoll_dispatch(buf + i);
+
+			// anything allocated outside of an irc_event or sync is done with by now
+			scratch_restore((struct scratch_pos){});
 		}
 	}
 
@@ -1,32 +1,61 @@
 #ifndef MORPHEUS_H_
 #define MORPHEUS_H_
 #include <curl/curl.h>
-#include <yajl/yajl_tree.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <iconv.h>
 #include "stb_sb.h"
 
 struct client;
+struct session;
 struct sock;
 struct net_msg;
 struct room;
 struct sync_state;
 struct irc_msg;
+struct irc_split;
+struct room_op;
+struct dir_list;
+struct direct_index;
+struct json_node;
+struct phash;
+struct handler_stats;
+struct scratch_pos;
 
 typedef uint32_t mtx_id;
+typedef struct json_node* json_val;
 
 struct client*  client_new        (int socket, struct sockaddr* addr, socklen_t);
 void            client_del        (struct client*);
 void            client_tick       (void);
+void            client_epollout   (struct client*, bool enable);
+bool            client_flush      (struct client*);
+bool            client_in_room    (struct client*, mtx_id room);
+void            client_room_add   (struct client*, struct room*);
+void            client_room_del   (struct client*, struct room*);
+struct client*  client_find       (int irc_sock);
+iconv_t         client_iconv      (struct client*);
+void            client_set_charset(struct client*, const char* charset);
+
+void            session_login     (struct client*);
+void            session_attach    (struct session*, struct client*);
+void            session_detach    (struct client*);
+void            session_send      (struct session*, struct room*, struct irc_msg*);
+void            session_send_except(struct session*, struct client* skip, struct room*, struct irc_msg*);
+void            session_broadcast (struct session* skip, struct room*, struct irc_msg*);
+void            session_tick      (void);
+struct session* session_any       (void);
+bool            session_in_room   (struct room*);
 
 bool            net_init          (void);
 void            net_update        (int event_mask, struct sock*);
-struct net_msg* net_msg_new       (struct client*, int type);
+struct net_msg* net_msg_new       (struct session*, int type);
 void            net_msg_send      (struct net_msg*);
+void            net_flush         (void);
 void            net_msg_free      (struct net_msg*);
 
 mtx_id          id_intern         (const char* id);
@@ -34,40 +63,118 @@ const char*     id_lookup         (mtx_id);
 int             id_server_hash    (mtx_id);
 const char*     id_server_unhash  (int hash);
 
-void            mtx_send_sync     (struct client*);
-void            mtx_send_login    (struct client*);
-void            mtx_send_msg      (struct client*, struct room*, const char* msg);
-void            mtx_send_topic    (struct client*, struct room*, const char* topic);
-void            mtx_send_join     (struct client*, const char* room);
-void            mtx_send_leave    (struct client*, struct room*);
-void            mtx_send_pm_setup (struct client*, mtx_id user, const char* text);
-void            mtx_recv          (struct client*, struct net_msg*);
-void            mtx_event         (const char* ev, struct sync_state*, yajl_val);
+void            mtx_send_sync     (struct session*);
+void            mtx_send_login    (struct session*, const char* user, const char* pass);
+void            mtx_send_msg      (struct session*, struct client* from, struct room*, const char* msg);
+void            mtx_send_topic    (struct session*, struct room*, const char* topic);
+void            mtx_send_join     (struct session*, struct client* from, const char* room);
+void            mtx_send_leave    (struct session*, struct client* from, struct room*);
+void            mtx_room_op_free  (struct room_op*);
+void            mtx_msg_abandon   (struct net_msg*);
+void            mtx_send_pm       (struct session*, mtx_id user, const char* text);
+void            mtx_send_members  (struct session*, struct room*, struct client* names_to);
+void            mtx_send_directory(struct session*, const char* since, uint32_t generation);
+void            mtx_send_profile  (struct session*, mtx_id user);
+void            mtx_recv          (struct session*, struct net_msg*);
+void            mtx_event         (struct sync_state*, json_val);
+char*           mtx_event_filter  (void);
+const struct handler_stats* mtx_event_stats(size_t index, const char** name);
 
 int             irc_send          (struct client*, struct irc_msg*);
+int             irc_send_raw      (struct client*, const char* buf, size_t len);
+int             irc_format        (struct client*, struct irc_msg*, char buf[static 1024]);
+bool            irc_split_init    (struct irc_split*, struct irc_msg*, size_t nick_len);
+const char*     irc_split_next    (struct irc_split*);
+void            irc_send_welcome  (struct client*);
+bool            irc_attach_room   (struct client*, struct room*);
 void            irc_send_names    (struct client*, struct room*);
-void            irc_recv          (struct client*, const char* buf, size_t n);
+void            irc_send_topic    (struct client*, struct room*);
+void            irc_send_whois    (struct client*, mtx_id user);
+bool            irc_recv          (struct client*, const char* buf, size_t n);
 void            irc_event         (struct client*, struct irc_msg*);
 
+void            directory_tick    (void);
+void            directory_recv    (struct session*, struct net_msg*, json_val);
+void            directory_list    (struct client*, const char* params);
+void            directory_list_continue(struct client*);
+void            directory_list_free(struct client*);
+
 struct room*    room_new          (mtx_id id);
 struct room*    room_lookup_mtx   (mtx_id id);
 struct room*    room_lookup_irc   (const char* chan);
 void            room_free         (struct room*);
+void            room_ref          (struct room*);
+void            room_unref        (struct room*);
+void            room_tick         (void);
+bool            room_members_loaded(struct room*);
 struct member*  room_member_get   (struct room*, mtx_id member_id);
 struct member*  room_member_add   (struct room*, mtx_id member_id, int state);
 void            room_member_del   (struct room*, mtx_id member_id);
-int             room_get_irc_info (struct room*, struct client*, char** name);
-struct room*    room_find_query   (struct client*, mtx_id partner);
+int             room_get_irc_info (struct room*, struct session*, char** name);
+struct room*    room_find_query   (struct session*, mtx_id partner);
+struct room*    room_at           (size_t index);
+const mtx_id*   room_user_rooms   (mtx_id user, size_t* count);
+bool            room_is_large     (struct room*);
+char            room_member_prefix(struct room*, int power);
+sb(char)*       room_names_lines  (struct room*);
+void            room_names_update (struct room*, struct member*);
+void            room_names_invalidate(struct room*);
+bool            room_touch_active (struct room*, mtx_id user);
+bool            room_drop_active  (struct room*, mtx_id user);
+bool            room_user_shares  (struct client*, mtx_id user);
 
 char*           cvt_m2i_user      (mtx_id id);
 mtx_id          cvt_i2m_user      (const char* irc_id);
-sb(char)        cvt_m2i_msg_plain (const char* mtx_msg);
-sb(char)        cvt_m2i_msg_rich  (const char* mtx_msg);
+char*           cvt_m2i_msg_plain (const char* mtx_msg);
+char*           cvt_m2i_msg_rich  (const char* mtx_msg);
 sb(char)        cvt_i2m_msg       (const char* irc_msg, sb(char)* stripped);
-
-bool            presence_update   (struct client*, mtx_id, const char* pres_str);
-
-bool            yajl_generate     (char** out, const char* fmt, ...);
+size_t          cvt_utf8_valid    (const char* str, size_t len);
+sb(char)        cvt_charset_fix   (iconv_t, const char* str, size_t len);
+
+bool            presence_update   (struct session*, mtx_id, const char* pres_str);
+const char*     presence_away     (mtx_id);
+void            presence_forget   (mtx_id);
+void            presence_tick     (void);
+
+struct room*    direct_room       (struct session*, mtx_id user);
+void            direct_update     (struct session*, json_val content);
+bool            direct_queue      (struct session*, mtx_id user, const char* text);
+bool            direct_loaded     (struct session*);
+bool            direct_defer      (struct session*, mtx_id user, const char* text);
+void            direct_flush      (struct session*, bool failed);
+void            direct_created    (struct session*, mtx_id user, mtx_id room);
+char*           direct_json       (struct session*);
+void            direct_free       (struct session*);
+
+void            profile_update    (mtx_id, const char* display_name, const char* avatar_url);
+bool            profile_get       (mtx_id, const char** display_name, const char** avatar_url);
+void            profile_fetch     (struct client* whois_reply, mtx_id);
+void            profile_recv      (struct session*, struct net_msg*, json_val);
+void            profile_tick      (void);
+
+long            retry_timeout     (struct net_msg*);
+void            retry_record      (int type, long ms);
+long            retry_backoff     (struct net_msg*);
+
+struct json_tmpl* json_tmpl_compile(const char* fmt);
+const char*     json_tmpl_render  (struct json_tmpl*, ...);
+uint64_t        time_ms           (void);
+uint64_t        cpu_ns            (void);
+void            phash_init        (struct phash*, const void* keys, size_t stride, size_t count, bool nocase);
+int             phash_find        (const struct phash*, const char* key);
+
+void*           scratch_alloc     (size_t);
+char*           scratch_strndup   (const char*, size_t);
+char*           scratch_printf    (const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+struct scratch_pos scratch_save   (void);
+void            scratch_restore   (struct scratch_pos);
+
+json_val        json_parse        (char* buf, size_t len);
+json_val        json_parse_copy   (const char* buf, size_t len);
+void            json_free         (json_val);
+void            json_arena_size   (json_val, size_t* used, size_t* reserved);
+const char*     json_str          (json_val);
+json_val        json_get          (json_val, const char** path, int type);
 
 #define NUM_ARGS(...) (sizeof((const void*[]){ __VA_ARGS__ })/sizeof(void*))
 
@@ -89,6 +196,31 @@ bool            yajl_generate     (char** out, const char* fmt, ...);
 #define IRC_SEND_NUM(client, num, ...)\
 	IRC_SEND((client), (num), client->irc_nick ?: "*", __VA_ARGS__)
 
+// Sends to every client of a session that is in the room, or to all of them if room is NULL.
+#define SESSION_SEND_PF(sess, room, pre, fl, command, ...) \
+	session_send(sess, room, &(struct irc_msg){\
+		.cmd = (command),\
+		.prefix = (pre),\
+		.params = { __VA_ARGS__ },\
+		.pcount = NUM_ARGS(__VA_ARGS__),\
+		.flags = (fl)\
+	});
+
+// For changes to a room's shared state, which are only seen once no matter how many sessions
+// are in the room. Goes to the clients of every session (other than skip) that are in it.
+#define SESSION_BROADCAST_PF(skip, room, pre, fl, command, ...) \
+	session_broadcast(skip, room, &(struct irc_msg){\
+		.cmd = (command),\
+		.prefix = (pre),\
+		.params = { __VA_ARGS__ },\
+		.pcount = NUM_ARGS(__VA_ARGS__),\
+		.flags = (fl)\
+	});
+
+// Each client gets its own nick as the first param, so this works for NOTICEs to the user too.
+#define SESSION_SEND_NUM(sess, num, ...)\
+	SESSION_SEND_PF((sess), NULL, NULL, SF_NUMERIC, (num), __VA_ARGS__)
+
 // For discriminating epoll fds
 enum {
 	EPOLL_TAG_CURL,
@@ -106,8 +238,14 @@ enum {
 	MTX_MSG_TOPIC,
 	MTX_MSG_JOIN,
 	MTX_MSG_LEAVE,
+	MTX_MSG_FILTER,
+	MTX_MSG_MEMBERS,
+	MTX_MSG_STATE,
+	MTX_MSG_DIRECTORY,
+	MTX_MSG_PROFILE,
 	
-	MTX_MSG_PM_LOOKUP,
+	MTX_MSG_DIRECT,
+	MTX_MSG_DIRECT_SET,
 	MTX_MSG_PM_CREATE,
 };
 
@@ -124,6 +262,7 @@ enum {
 enum {
 	IRC_CAP_SERVER_TIME = (1 << 0),
 	IRC_CAP_AWAY_NOTIFY = (1 << 1),
+	IRC_CAP_LAZY_ATTACH = (1 << 2), // rooms aren't shown until the client JOINs them
 };
 
 // For mtx sync_state flags
@@ -131,11 +270,14 @@ enum {
 	SYNC_TIMELINE = (1 << 0),
 	SYNC_NEW_ROOM = (1 << 1),
 	SYNC_INVITE   = (1 << 2),
+	SYNC_DETACHED = (1 << 3), // update room state only, don't tell IRC
 };
 
 // For irc_msg_send, to know operations to apply to the irc_msg struct before sending.
 enum {
 	SF_CVT_PREFIX  = (1 << 0),
+	SF_NUMERIC     = (1 << 1), // prepend the receiving client's nick to the params
+	SF_BACKLOG     = (1 << 2), // keep for replay if the session has no clients
 };
 
 // Returned by room_get_irc_name's type argument
@@ -153,6 +295,65 @@ enum {
 	MEMBER_STATE_INVITED,
 };
 
+// Types of json_node, and JSON_ANY for json_get
+enum {
+	JSON_STRING = 1,
+	JSON_NUMBER,
+	JSON_OBJECT,
+	JSON_ARRAY,
+	JSON_TRUE,
+	JSON_FALSE,
+	JSON_NULL,
+	JSON_ANY,
+};
+
+enum {
+	JSON_F_INTEGER = (1 << 0), // u.number.i is exact
+	JSON_F_ESCAPED = (1 << 1), // u.string hasn't been unescaped yet, use json_str
+};
+
+struct json_node {
+	uint8_t type;
+	uint8_t flags;
+	union {
+		char* string;
+		struct {
+			long long i;
+			double d;
+		} number;
+		struct {
+			char** keys;
+			json_val* values;
+			size_t len;
+		} object;
+		struct {
+			json_val* values;
+			size_t len;
+		} array;
+	} u;
+};
+
+// A point in the scratch arena to go back to, see scratch_save
+struct scratch_pos {
+	size_t block;
+	size_t used;
+};
+
+struct phash {
+	const void* keys;
+	size_t      stride;
+	bool        nocase;
+	uint32_t    seed;
+	uint32_t    mask;
+	int16_t*    slots;
+};
+
+// How often a handler has run, and for how long. See STATS.
+struct handler_stats {
+	uint64_t calls;
+	uint64_t cpu_ns;
+};
+
 struct sock {
 	int tag;
 	int fd;
@@ -164,8 +365,11 @@ struct net_msg {
 	long  curl_status;
 	char* data;
 	void* user_data;
-	bool  done;
+	int   attempts;
+	uint64_t sent_at;  // time_ms() of the last attempt
+	uint64_t retry_at; // non-zero while waiting to be re-sent
 	struct curl_slist* headers;
+	struct session* session;
 	struct net_msg* next;
 	char errbuf[CURL_ERROR_SIZE];
 };
@@ -185,22 +389,51 @@ struct room {
 	char*  canon;        // XXX: make this a mtx_id
 	char*  display_name; // NOTE: only used to pick the most appropriate alias currently.
 
+	char*  topic;
+	mtx_id topic_setter;
+	time_t topic_time;
+
 	sb(struct member) members;
 	bool invite_only;
 	time_t created;
 
+	// members are lazy-loaded, so the sync summary tells us what we're missing
+	bool has_summary;
+	int  joined_count;
+	int  invited_count;
+	sb(mtx_id) heroes;
+	bool members_loaded; // got the full list from /members
+
+	sb(mtx_id) active;   // recent speakers, oldest first, see room_is_large
+
+	// from m.room.power_levels, 0 until we've seen it. See room_member_prefix
+	int op_level;
+	int hop_level;
+
+	sb(sb(char)) names;  // cached 353 payloads, see room_names_lines
+	bool names_valid;
+	bool names_large;    // whether they were built as a large room
+
+	int refs;            // clients that have it in irc_rooms, see room_tick
+
 	// TODO: required power level for OP, HOP etc?
 };
 
 struct sync_state {
 	struct room* room;
-	struct client* client;
-	yajl_val new_topic;
+	struct session* session;
 	int flags;
 
 	const char* inviter;
 };
 
+// A message we've sent to matrix, kept until its echo comes back through /sync.
+struct sent_msg {
+	size_t txid;
+	char*  event_id; // NULL until the PUT that sent it returns
+	struct client* client; // where it came from, the other clients are shown the echo
+};
+
 struct irc_msg {
 	const char* tags;
 	const char* prefix;
@@ -210,6 +443,69 @@ struct irc_msg {
 	int flags;
 };
 
+// State for breaking up a message that's too long for one IRC line, see irc_split_next.
+struct irc_split {
+	const char* p;
+	const char* end;
+	size_t budget;   // bytes of the original text per line
+	bool   ctcp;     // an ACTION, which each line needs wrapping in
+	int    fmt;      // formatting active at the end of the last line
+	char   color[8];
+	char   line[512];
+};
+
+// A JOIN or PART from IRC. These are queued so that only a few at a time are sent to
+// the homeserver, since clients tend to join all their channels at once.
+struct room_op {
+	int     type;      // MTX_MSG_JOIN or MTX_MSG_LEAVE
+	mtx_id  room;      // for joins by alias, unknown until the join succeeds
+	sb(int) irc_socks; // the clients waiting on it, empty for auto-joins
+	char    name[];    // as given by IRC
+};
+
+// An IRC line held by a detached session, replayed when a client attaches.
+struct backlog_line {
+	mtx_id room;
+	char*  line; // formatted with a server-time tag, without the trailing CRLF
+};
+
+// The matrix half of a connection. It outlives the IRC client that logged it
+// in, so a client reconnecting with the same credentials can resume it.
+struct session {
+	char* user;
+	char* pass_hash; // crypt(3) of the password, to authenticate reattaching clients
+
+	sb(struct sent_msg) mtx_sent; // to prevent echo of our own mtx events
+
+	char* mtx_token;
+	char* mtx_since;
+	char* mtx_server;
+	char* mtx_filter; // id of our registered sync filter, if any
+	char* mtx_device;
+
+	mtx_id mtx_id;
+	bool   dead; // the sync failed for good, session_tick will get rid of it
+
+	size_t mtx_txid;
+
+	time_t last_active;
+	time_t last_sync;
+	time_t detach_time; // when the last client went away, 0 while attached
+
+	sb(struct client*) clients;
+	sb(struct backlog_line) backlog;
+
+	struct direct_index* direct;  // 1:1 rooms from m.direct, see direct.c
+
+	sb(mtx_id) sync_joins;        // joined after the full-state sync in flight was sent, see mtx_recv_sync
+
+	sb(struct room_op*) room_ops; // waiting to be sent
+	int room_ops_sent;            // how many are in flight, a JOIN counts until its STATE is in
+
+	struct net_msg* msgs;
+	struct session* next;
+};
+
 struct client {
 	char* irc_user;
 	char* irc_nick;
@@ -219,27 +515,20 @@ struct client {
 	int   irc_state;
 
 	sb(char)   irc_buf;      // space for buffering incoming IRC messages
+	sb(char)   irc_out;      // what the socket wouldn't take yet, sent on EPOLLOUT
 	sb(mtx_id) irc_rooms;    // room IDs that we are joined to in IRC
-	sb(char*)  mtx_sent_ids; // to prevent echo of our own mtx events
 
-	char* mtx_token;
-	char* mtx_since;
-	char* mtx_server;
+	struct session* session; // NULL until logged in
+	struct dir_list* irc_list; // LIST still being sent, see directory.c
 
-	mtx_id mtx_id;
-
-	size_t mtx_txid;
+	char*   irc_charset; // what to assume for input that isn't UTF-8, NULL for the default
+	iconv_t irc_iconv;   // opened the first time it's needed, see client_iconv
 
 	time_t connect_time;
 	time_t last_cmd_time;
-	time_t last_active;
-
-	time_t last_sync;
-	time_t next_sync;
 
 	int epoll_irc_tag;
 
-	struct net_msg* msgs;
 	struct client* next;
 };
 
@@ -248,6 +537,9 @@ extern struct global_state {
 	const char* mtx_server_name;
 	const char* device_id;
 	const char* device_name;
+	int detach_timeout; // seconds a session stays logged in without any clients
+	int large_room_members; // rooms this big only list active members, 0 = off
+	const char* irc_charset; // default for client_set_charset
 	int epoll;
 } global;
 
@@ -261,10 +553,22 @@ extern struct global_state {
 #define MIN(_a,_b) ({ typeof(_a) a = (_a); typeof(_b) b = (_b); a<b?a:b; })
 #define MAX(_a,_b) ({ typeof(_a) a = (_a); typeof(_b) b = (_b); a<b?b:a; })
 
-#define YAJL_PATH_EXPAND(...) { __VA_ARGS__, NULL }
-#define YAJL_GET(root, type, path) ({               \
-	static const char* p[] = YAJL_PATH_EXPAND path; \
-	yajl_tree_get((root), p, (type));     \
+#define JSON_PATH_EXPAND(...) { __VA_ARGS__, NULL }
+#define JSON_GET(root, type, path) ({               \
+	static const char* p[] = JSON_PATH_EXPAND path; \
+	json_get((root), p, (type));          \
+})
+
+#define JSON_IS_STRING(v)  ((v) && (v)->type == JSON_STRING)
+#define JSON_IS_OBJECT(v)  ((v) && (v)->type == JSON_OBJECT)
+#define JSON_IS_ARRAY(v)   ((v) && (v)->type == JSON_ARRAY)
+#define JSON_IS_INTEGER(v) ((v) && (v)->type == JSON_NUMBER && ((v)->flags & JSON_F_INTEGER))
+
+// compiles the template the first time this line runs, and renders it from then on
+#define JSON_TMPL(fmt, ...) ({                                    \
+	static struct json_tmpl* t;                                   \
+	if(!t) t = json_tmpl_compile(fmt);                            \
+	json_tmpl_render(t, __VA_ARGS__);                             \
 })
 
 #define ISDIGIT(x)    (x >= '0' && x <= '9')
@@ -272,4 +576,19 @@ extern struct global_state {
 
 #define MTX_CLIENT "/_matrix/client/r0"
 
+// XXX: I would like to poll for longer, but anything over ~60s seems to time out with nginx
+#define MTX_SYNC_POLL_MS 55000
+
+// Most timeline events we'll accept per room in a single sync
+#define MTX_TIMELINE_LIMIT 20
+
+// Most JOINs / PARTs a session will have in flight at once
+#define MTX_ROOM_OPS_MAX 4
+
+// Most IRC lines a detached session will hold on to
+#define SESSION_BACKLOG_MAX 500
+
+// Recent speakers remembered per room, for trimming NAMES in large rooms
+#define ROOM_ACTIVE_MAX 256
+
 #endif
@@ -1,4 +1,3 @@
-#include <yajl/yajl_tree.h>
 #include <yajl/yajl_gen.h>
 #include <string.h>
 #include <stdbool.h>
@@ -6,22 +5,35 @@
 
 #define yajl_gen_strlit(j, str) yajl_gen_string(j, str, sizeof(str)-1)
 
-#define MTX_SET_URL(client, msg, fmt, ...) ({\
+#define MTX_SET_URL(sess, msg, fmt, ...) ({\
 	char* url;\
-	assert(asprintf(&url, "%s" MTX_CLIENT fmt "?access_token=%s", global.mtx_server_base_url, ##__VA_ARGS__, client->mtx_token) != -1);\
+	assert(asprintf(&url, "%s" MTX_CLIENT fmt "?access_token=%s", global.mtx_server_base_url, ##__VA_ARGS__, sess->mtx_token) != -1);\
 	curl_easy_setopt(msg->curl, CURLOPT_URL, url);\
 	free(url);\
 })
 
-#define cprintf(fmt, ...) printf("[%02d] " fmt, client->irc_sock, ##__VA_ARGS__)
+#define cprintf(fmt, ...) printf("[%s] " fmt, sess->user, ##__VA_ARGS__)
 #define net_msg_perror(msg, fmt, ...) cprintf(fmt " FAIL: [%ld] [%s] [%s]\n", ##__VA_ARGS__, msg->curl_status, msg->errbuf, msg->data)
 
-struct pm_data {
-	mtx_id friend;
-	char message[];
+static void mtx_send_pm_create_room (struct session*, mtx_id user);
+static void mtx_send_direct         (struct session*);
+static void mtx_send_direct_set     (struct session*);
+static void mtx_send_filter         (struct session*);
+static void mtx_send_state          (struct session*, struct room_op* op);
+static void mtx_room_ops_pump       (struct session*);
+
+struct members_req {
+	mtx_id  room;
+	sb(int) names_socks; // clients to send NAMES to once it's done, by socket
+};
+
+struct mtx_filter {
+	mtx_id user;
+	char*  id;
 };
 
-static void mtx_send_pm_create_room (struct client*, struct pm_data* data);
+// filters are registered once per account, and reused for later logins.
+static sb(struct mtx_filter) mtx_filters;
 
 const char* mtx_msg_strs[] = {
 	[MTX_MSG_SYNC]      = "SYNC",
@@ -30,145 +42,236 @@ const char* mtx_msg_strs[] = {
 	[MTX_MSG_TOPIC]     = "TOPIC",
 	[MTX_MSG_JOIN]      = "JOIN",
 	[MTX_MSG_LEAVE]     = "LEAVE",
-	[MTX_MSG_PM_LOOKUP] = "PM_LOOKUP",
+	[MTX_MSG_FILTER]    = "FILTER",
+	[MTX_MSG_MEMBERS]   = "MEMBERS",
+	[MTX_MSG_STATE]     = "STATE",
+	[MTX_MSG_DIRECTORY] = "DIRECTORY",
+	[MTX_MSG_PROFILE]   = "PROFILE",
+	[MTX_MSG_DIRECT]    = "DIRECT",
+	[MTX_MSG_DIRECT_SET]= "DIRECT_SET",
 	[MTX_MSG_PM_CREATE] = "PM_CREATE",
 };
 
-void mtx_recv_sync(struct client* client, struct net_msg* msg){
-	yajl_val root  = yajl_tree_parse(msg->data, NULL, 0);
+// clients can go away while a request is in flight, so requests remember them by socket.
+static struct client* mtx_find_client(struct session* sess, int irc_sock){
+	sb_each(c, sess->clients){
+		if((*c)->irc_sock == irc_sock) return *c;
+	}
+	return NULL;
+}
+
+// we're now in room, which might be news to the other sessions in it.
+static void mtx_room_joined(struct session* sess, struct room* room){
+	struct member* self = room_member_get(room, sess->mtx_id);
+	if(self && self->state == MEMBER_STATE_JOINED) return;
+
+	room_member_add(room, sess->mtx_id, MEMBER_STATE_JOINED);
+
+	// same as in mtx_room_left, they won't see it as a change when their sync has it
+	char* irc_room = NULL;
+	if(room_get_irc_info(room, sess, &irc_room) > ROOM_IRC_QUERY){
+		SESSION_BROADCAST_PF(sess, room, id_lookup(sess->mtx_id), SF_CVT_PREFIX, "JOIN", irc_room);
+	}
+}
+
+// we're no longer in room, take it away from the session's clients.
+static void mtx_room_left(struct session* sess, struct room* room){
+	struct member* self = room_member_get(room, sess->mtx_id);
+	bool was_joined = self && self->state == MEMBER_STATE_JOINED;
+
+	char* irc_room = NULL;
+	int   irc_room_type = room_get_irc_info(room, sess, &irc_room);
 
-	yajl_val since    = YAJL_GET(root, yajl_t_string, ("next_batch"));
-	yajl_val presence = YAJL_GET(root, yajl_t_array , ("presence", "events"));
-	yajl_val joins    = YAJL_GET(root, yajl_t_object, ("rooms", "join"));
-	yajl_val leaves   = YAJL_GET(root, yajl_t_object, ("rooms", "leave"));
-	yajl_val invites  = YAJL_GET(root, yajl_t_object, ("rooms", "invite"));
+	sb_each(c, sess->clients){
+		if(!client_in_room(*c, room->id)) continue;
+
+		client_room_del(*c, room);
+		if(irc_room_type > ROOM_IRC_QUERY){
+			IRC_SEND_PF(*c, id_lookup(sess->mtx_id), SF_CVT_PREFIX, "PART", irc_room);
+		}
+	}
+
+	// other sessions' syncs won't see this as a change once we've removed ourselves
+	if(was_joined && irc_room_type > ROOM_IRC_QUERY){
+		SESSION_BROADCAST_PF(sess, room, id_lookup(sess->mtx_id), SF_CVT_PREFIX, "PART", irc_room);
+	}
+
+	room_member_del(room, sess->mtx_id);
+}
+
+static void mtx_recv_sync(struct session* sess, json_val root, bool full_state){
+	struct scratch_pos scratch = scratch_save();
+
+	json_val presence = JSON_GET(root, JSON_ARRAY , ("presence", "events"));
+	json_val joins    = JSON_GET(root, JSON_OBJECT, ("rooms", "join"));
+	json_val leaves   = JSON_GET(root, JSON_OBJECT, ("rooms", "leave"));
+	json_val invites  = JSON_GET(root, JSON_OBJECT, ("rooms", "invite"));
+	json_val account  = JSON_GET(root, JSON_ARRAY , ("account_data", "events"));
+
+	if(account){
+		for(size_t i = 0; i < account->u.array.len; ++i){
+			json_val type = JSON_GET(account->u.array.values[i], JSON_STRING, ("type"));
+			if(type && strcmp(json_str(type), "m.direct") == 0){
+				mtx_send_direct(sess);
+				break;
+			}
+		}
+	}
 
 	if(presence){
 		for(size_t i = 0; i < presence->u.array.len; ++i){
-			yajl_val obj = presence->u.array.values[i];
-			if(!YAJL_IS_OBJECT(obj)) continue;
+			json_val obj = presence->u.array.values[i];
+			if(!JSON_IS_OBJECT(obj)) continue;
 
-			yajl_val type = YAJL_GET(obj, yajl_t_string, ("type"));
-			if(!type || strcmp(type->u.string, "m.presence") != 0) continue;
+			json_val type = JSON_GET(obj, JSON_STRING, ("type"));
+			if(!type || strcmp(json_str(type), "m.presence") != 0) continue;
 
-			yajl_val status = YAJL_GET(obj, yajl_t_string, ("content", "presence"));
-			yajl_val user   = YAJL_GET(obj, yajl_t_string, ("sender"));
-			yajl_val ago    = YAJL_GET(obj, yajl_t_number, ("content", "last_active_ago"));
+			json_val status = JSON_GET(obj, JSON_STRING, ("content", "presence"));
+			json_val user   = JSON_GET(obj, JSON_STRING, ("sender"));
+			json_val ago    = JSON_GET(obj, JSON_NUMBER, ("content", "last_active_ago"));
 
 			if(!user) continue;
-			mtx_id user_id = id_intern(user->u.string);
+			mtx_id user_id = id_intern(json_str(user));
 
-			if(status && (client->irc_caps & IRC_CAP_AWAY_NOTIFY)){
+			if(status){
 				const char* away_msg =
-					strcmp(status->u.string, "unavailable") == 0 ? "Idle" :
-					strcmp(status->u.string, "online")      == 0 ? NULL :
+					strcmp(json_str(status), "unavailable") == 0 ? "Idle" :
+					strcmp(json_str(status), "online")      == 0 ? NULL :
 					"Offline";
 
-				if(presence_update(client, user_id, status->u.string)){
-					cprintf("New presence for [%s]: %s\n", user->u.string, away_msg ?: "Online");
-					if(away_msg){
-						IRC_SEND_PF(client, user->u.string, SF_CVT_PREFIX, "AWAY", away_msg);
-					} else {
-						IRC_SEND_PF(client, user->u.string, SF_CVT_PREFIX, "AWAY");
+				if(presence_update(sess, user_id, json_str(status))){
+					cprintf("New presence for [%s]: %s\n", json_str(user), away_msg ?: "Online");
+
+					// only clients that can see them in a channel care
+					sb_each(c, sess->clients){
+						if(!((*c)->irc_caps & IRC_CAP_AWAY_NOTIFY)) continue;
+						if(!room_user_shares(*c, user_id)) continue;
+
+						if(away_msg){
+							IRC_SEND_PF(*c, json_str(user), SF_CVT_PREFIX, "AWAY", away_msg);
+						} else {
+							IRC_SEND_PF(*c, json_str(user), SF_CVT_PREFIX, "AWAY");
+						}
 					}
 				}
 			}
 
-			if(!client->last_active && YAJL_IS_INTEGER(ago) && user_id == client->mtx_id){
+			if(!sess->last_active && JSON_IS_INTEGER(ago) && user_id == sess->mtx_id){
 				// XXX: this is likely wrong, ago gets updated when we login? :(
 				//      figure out if our last active time is available somewhere else?
-				client->last_active = time(NULL) - (ago->u.number.i / 1000);
+				sess->last_active = time(NULL) - (ago->u.number.i / 1000);
 			}
 		}
 	}
 
 	for(size_t i = 0; joins && i < joins->u.object.len; ++i){
 		const char* room = joins->u.object.keys[i];
-		yajl_val obj = joins->u.object.values[i];
+		json_val obj = joins->u.object.values[i];
 		mtx_id room_id = id_intern(room);
 
 		cprintf("Processing events for [%s] (join)\n", room);
 
 		struct sync_state state = {
-			.room   = room_new(room_id),
-			.client = client,
+			.room    = room_new(room_id),
+			.session = sess,
 		};
 
-		room_member_add(state.room, client->mtx_id, MEMBER_STATE_JOINED);
+		mtx_room_joined(sess, state.room);
 
+		// only sent when it changes, so keep whatever we had before otherwise
+		json_val summary = JSON_GET(obj, JSON_OBJECT, ("summary"));
+		if(summary){
+			json_val heroes  = JSON_GET(summary, JSON_ARRAY , ("m.heroes"));
+			json_val joined  = JSON_GET(summary, JSON_NUMBER, ("m.joined_member_count"));
+			json_val invited = JSON_GET(summary, JSON_NUMBER, ("m.invited_member_count"));
+
+			if(heroes){
+				sb_free(state.room->heroes);
+				for(size_t j = 0; j < heroes->u.array.len; ++j){
+					if(!JSON_IS_STRING(heroes->u.array.values[j])) continue;
+					sb_push(state.room->heroes, id_intern(json_str(heroes->u.array.values[j])));
+				}
+			}
+			if(JSON_IS_INTEGER(joined)){
+				state.room->joined_count = joined->u.number.i;
+				state.room->has_summary = true;
+			}
+			if(JSON_IS_INTEGER(invited)){
+				state.room->invited_count = invited->u.number.i;
+				state.room->has_summary = true;
+			}
+		}
+
+		// clients that haven't been shown this room yet
+		sb(struct client*) new_clients = NULL;
 		bool known_to_irc = false;
-		sb_each(r, client->irc_rooms){
-			if(*r == room_id){
+
+		sb_each(c, sess->clients){
+			if(client_in_room(*c, room_id)){
 				known_to_irc = true;
-				break;
+			} else {
+				sb_push(new_clients, *c);
 			}
 		}
 
 		if(!known_to_irc){
-			sb_push(client->irc_rooms, room_id);
 			state.flags |= SYNC_NEW_ROOM;
 		}
 
-		yajl_val events;
+		json_val events;
 
 		// state events
-		events = YAJL_GET(obj, yajl_t_array, ("state", "events"));
+		events = JSON_GET(obj, JSON_ARRAY, ("state", "events"));
 		if(events){
 			for(size_t j = 0; j < events->u.array.len; ++j){
-				if(!YAJL_IS_OBJECT(events->u.array.values[j])) continue;
-
-				yajl_val type = YAJL_GET(events->u.array.values[j], yajl_t_string, ("type"));
-				if(!type) continue;
-
-				//cprintf("Join state: [%s]\n", type->u.string);
-				mtx_event(type->u.string, &state, events->u.array.values[j]);
+				mtx_event(&state, events->u.array.values[j]);
 			}
 		}
 
 		// FIXME: should we / can we do this after the timeline events?
 		char* irc_room = NULL;
-		int   irc_room_type = room_get_irc_info(state.room, client, &irc_room);
+		int   irc_room_type = room_get_irc_info(state.room, sess, &irc_room);
+
+		bool attached = known_to_irc;
+		sb_each(c, new_clients){
+			// with lazy-attach, channels stay hidden from IRC until the client JOINs them.
+			// queries are always attached, or PMs would go missing.
+			if(((*c)->irc_caps & IRC_CAP_LAZY_ATTACH) && irc_room_type > ROOM_IRC_QUERY){
+				continue;
+			}
 
-		if(!known_to_irc && irc_room_type > ROOM_IRC_QUERY){
-			IRC_SEND_PF(client, id_lookup(client->mtx_id), SF_CVT_PREFIX, "JOIN", irc_room);
-			irc_send_names(client, state.room);
+			client_room_add(*c, state.room);
+			attached = true;
+
+			if(irc_room_type > ROOM_IRC_QUERY){
+				IRC_SEND_PF(*c, id_lookup(sess->mtx_id), SF_CVT_PREFIX, "JOIN", irc_room);
+				irc_send_names(*c, state.room);
+			}
+		}
+
+		// with no clients at all, events still go through to the session's backlog.
+		if(!attached && sb_count(sess->clients)){
+			state.flags |= SYNC_DETACHED;
 		}
 
 		// timeline events
 		state.flags |= SYNC_TIMELINE;
-		events = YAJL_GET(obj, yajl_t_array, ("timeline", "events"));
+		events = JSON_GET(obj, JSON_ARRAY, ("timeline", "events"));
 		if(events){
 			for(size_t j = 0; j < events->u.array.len; ++j){
-				if(!YAJL_IS_OBJECT(events->u.array.values[j])) continue;
-
-				yajl_val type = YAJL_GET(events->u.array.values[j], yajl_t_string, ("type"));
-				if(!type) continue;
-
-				//cprintf("Join timel: [%s]\n", type->u.string);
-				mtx_event(type->u.string, &state, events->u.array.values[j]);
+				mtx_event(&state, events->u.array.values[j]);
 			}
 		}
 
-		if(state.new_topic && irc_room){
-			yajl_val topic  = YAJL_GET(state.new_topic, yajl_t_string, ("content", "topic"));
-			yajl_val sender = YAJL_GET(state.new_topic, yajl_t_string, ("sender"));
-			yajl_val epoch  = YAJL_GET(state.new_topic, yajl_t_number, ("origin_server_ts"));
-
-			if(topic && sender && YAJL_IS_INTEGER(epoch)){
-				char epoch_str[32] = "";
-				snprintf(epoch_str, sizeof(epoch_str), "%zu", (size_t)epoch->u.number.i / 1000);
-
-				mtx_id sender_id = id_intern(sender->u.string);
-				char* hostmask = cvt_m2i_user(sender_id);
-
-				IRC_SEND_NUM(client, "332", irc_room, topic->u.string);
-				IRC_SEND_NUM(client, "333", irc_room, hostmask, epoch_str);
-
-				free(hostmask);
+		if(irc_room_type > ROOM_IRC_QUERY){
+			sb_each(c, new_clients){
+				if(client_in_room(*c, room_id)){
+					irc_send_topic(*c, state.room);
+				}
 			}
 		}
 
-		free(irc_room);
+		sb_free(new_clients);
 	}
 
 	for(size_t i = 0; leaves && i < leaves->u.object.len; ++i){
@@ -177,49 +280,50 @@ void mtx_recv_sync(struct client* client, struct net_msg* msg){
 
 		cprintf("Processing events for [%s] (leave)\n", room);
 
-		struct sync_state state = {
-			.room   = room_new(room_id),
-			.client = client,
-		};
+		mtx_room_left(sess, room_new(room_id));
+	}
 
-		char* irc_room = NULL;
-		if(room_get_irc_info(state.room, client, &irc_room) > ROOM_IRC_QUERY){
-			IRC_SEND_PF(client, id_lookup(client->mtx_id), SF_CVT_PREFIX, "PART", irc_room);
-		}
-		free(irc_room);
-		room_member_del(state.room, client->mtx_id);
+	// a full-state sync lists every room we're in, so we must have left any that are missing.
+	if(full_state){
+		struct room* room;
+		for(size_t i = 0; (room = room_at(i)); ++i){
+			struct member* self = room_member_get(room, sess->mtx_id);
+			if(!self || self->state != MEMBER_STATE_JOINED) continue;
 
-		sb_each(r, client->irc_rooms){
-			if(*r == room_id){
-				sb_erase(client->irc_rooms, r - client->irc_rooms);
-				break;
+			const char* path[] = { id_lookup(room->id), NULL };
+			if(joins && json_get(joins, path, JSON_OBJECT)) continue;
+
+			// joined while this sync was on its way, so it can't know about it yet
+			bool recent = false;
+			sb_each(r, sess->sync_joins){
+				if(*r == room->id) recent = true;
 			}
+			if(recent) continue;
+
+			cprintf("Not in [%s] any more\n", path[0]);
+			mtx_room_left(sess, room);
 		}
+		sb_free(sess->sync_joins);
 	}
 
 	for(size_t i = 0; invites && i < invites->u.object.len; ++i){
 		const char* room = invites->u.object.keys[i];
-		yajl_val obj = invites->u.object.values[i];
+		json_val obj = invites->u.object.values[i];
 		mtx_id room_id = id_intern(room);
 
 		cprintf("Processing events for [%s] (invite)\n", room);
 
 		struct sync_state state = {
-			.room   = room_new(room_id),
-			.client = client,
-			.flags  = SYNC_INVITE,
+			.room    = room_new(room_id),
+			.session = sess,
+			.flags   = SYNC_INVITE,
 		};
 
-		yajl_val events = YAJL_GET(obj, yajl_t_array, ("invite_state", "events"));
+		json_val events = JSON_GET(obj, JSON_ARRAY, ("invite_state", "events"));
 
 		if(events){
 			for(size_t j = 0; j < events->u.array.len; ++j){
-				if(!YAJL_IS_OBJECT(events->u.array.values[j])) continue;
-
-				yajl_val type = YAJL_GET(events->u.array.values[j], yajl_t_string, ("type"));
-				if(!type) continue;
-
-				mtx_event(type->u.string, &state, events->u.array.values[j]);
+				mtx_event(&state, events->u.array.values[j]);
 			}
 		}
 
@@ -228,49 +332,44 @@ void mtx_recv_sync(struct client* client, struct net_msg* msg){
 		//      If there is a way to get that before joining, then I'd like to know...
 #if 0
 		int room_type;
-		char* irc_room = room_get_irc_name(state.room, client, &room_type);
+		char* irc_room = room_get_irc_name(state.room, sess, &room_type);
 
 		if(room_type == ROOM_IRC_QUERY){
 			// auto accept the invite if it's a private message room
 			// TODO: we should probably send a NOTICE or something about this?
-			mtx_send_join(client, room);
+			mtx_send_join(sess, NULL, room);
 		} else if(irc_room){
 			// otherwise send an IRC invite
 			assert(state.inviter);
-			IRC_SEND_PF(client, state.inviter, SF_CVT_PREFIX, "INVITE", client->irc_nick, irc_room);
+			SESSION_SEND_PF(sess, NULL, state.inviter, SF_CVT_PREFIX | SF_NUMERIC, "INVITE", irc_room);
 		}
 
-		free(irc_room);
 #else
-		mtx_send_join(client, room);
+		mtx_send_join(sess, NULL, room);
 #endif
 	}
 
-#if 0
-	FILE* f = fopen("debug.json", "r+");
-	if(!f){
-		f = fopen("debug.json", "w");
-		fputs(msg->data, f);
-	}
-	fclose(f);
-#endif
+	sess->last_sync = time(NULL);
+	scratch_restore(scratch);
+}
 
-	//cprintf("sync %d [%s]\n", client->irc_sock, msg->data);
+void mtx_recv(struct session* sess, struct net_msg* msg){
 
-	if(since){
-		free(client->mtx_since);
-		client->mtx_since = strdup(since->u.string);
+#if 0
+	// msg->data is parsed in place below, so the body has to be saved before that
+	if(msg->type == MTX_MSG_SYNC && msg->curl_status == 200){
+		FILE* f = fopen("debug.json", "r+");
+		if(!f){
+			f = fopen("debug.json", "w");
+			fputs(msg->data, f);
+		}
+		fclose(f);
 	}
+#endif
 
-	client->last_sync = time(NULL);
-
-	yajl_tree_free(root);
-}
-
-void mtx_recv(struct client* client, struct net_msg* msg){
-
-	time_t now = time(NULL);
-	yajl_val root = yajl_tree_parse(msg->data, NULL, 0);
+	// error responses are small and get logged as they are, so only parse the others in place
+	size_t len = sb_count(msg->data) - 1;
+	json_val root = msg->curl_status == 200 ? json_parse(msg->data, len) : json_parse_copy(msg->data, len);
 
 	switch(msg->type){
 
@@ -278,24 +377,34 @@ void mtx_recv(struct client* client, struct net_msg* msg){
 
 			// TODO: track state, we should only get one login?
 			if(msg->curl_status == 200){
-				yajl_val tkn  = YAJL_GET(root, yajl_t_string, ("access_token"));
-				yajl_val uid  = YAJL_GET(root, yajl_t_string, ("user_id"));
-				yajl_val serv = YAJL_GET(root, yajl_t_string, ("home_server"));
-				yajl_val dev  = YAJL_GET(root, yajl_t_string, ("device_id"));
+				json_val tkn  = JSON_GET(root, JSON_STRING, ("access_token"));
+				json_val uid  = JSON_GET(root, JSON_STRING, ("user_id"));
+				json_val serv = JSON_GET(root, JSON_STRING, ("home_server"));
+				json_val dev  = JSON_GET(root, JSON_STRING, ("device_id"));
 
 				if(tkn && uid){
-					client->mtx_token  = strdup(tkn->u.string);
-					client->mtx_id     = id_intern(uid->u.string);
-					client->mtx_server = strdup(serv->u.string);
-					client->irc_state |= IRC_STATE_REGISTERED;
+					sess->mtx_token  = strdup(json_str(tkn));
+					sess->mtx_id     = id_intern(json_str(uid));
+					sess->mtx_server = strdup(json_str(serv));
+					sess->mtx_device = dev ? strdup(json_str(dev)) : NULL;
+
+					sb_each(f, mtx_filters){
+						if(f->user == sess->mtx_id){
+							sess->mtx_filter = strdup(f->id);
+							break;
+						}
+					}
 
-					mtx_send_sync(client);
+					if(sess->mtx_filter){
+						mtx_send_sync(sess);
+					} else {
+						mtx_send_filter(sess);
+					}
 
-					IRC_SEND_NUM(client, "001", "Welcome to IRC");
-					IRC_SEND_NUM(client, "002", "Your device_id is", dev ? dev->u.string : "unknown");
-					IRC_SEND_NUM(client, "003", "This server was created at some point");
-					IRC_SEND_NUM(client, "004", "morpheus 1.0 ¯\\_(ツ)_/¯");
-					IRC_SEND_NUM(client, "005", "PREFIX=(ohv)@%+ CHANTYPES=#!+", "are supported by this server");
+					sb_each(c, sess->clients){
+						(*c)->irc_state |= IRC_STATE_REGISTERED;
+						irc_send_welcome(*c);
+					}
 
 				} else {
 					msg->curl_status = 0;
@@ -303,69 +412,217 @@ void mtx_recv(struct client* client, struct net_msg* msg){
 			}
 
 			if(msg->curl_status == 403){
-				IRC_SEND_NUM(client, "464", "Password incorrect");
+				SESSION_SEND_NUM(sess, "464", "Password incorrect");
 			} else if(msg->curl_status != 200){
 				net_msg_perror(msg, "LOGIN");
-				IRC_SEND(client, "NOTICE", "*", "Internal Server Error");
+				SESSION_SEND_NUM(sess, "NOTICE", "Internal Server Error");
+			}
+
+			// without a token, session_tick will clean this up once the clients are cut loose.
+			if(msg->curl_status != 200){
+				sb_each(c, sess->clients) (*c)->session = NULL;
+				sb_free(sess->clients);
+			}
+		} break;
+
+		case MTX_MSG_FILTER: {
+			json_val id = JSON_GET(root, JSON_STRING, ("filter_id"));
+
+			if(msg->curl_status == 200 && id){
+				struct mtx_filter f = {
+					.user = sess->mtx_id,
+					.id   = strdup(json_str(id)),
+				};
+				sb_push(mtx_filters, f);
+				sess->mtx_filter = strdup(f.id);
+			} else {
+				// not fatal, mtx_send_sync will send the filter inline instead.
+				net_msg_perror(msg, "FILTER");
 			}
+
+			mtx_send_sync(sess);
 		} break;
 
 		case MTX_MSG_SYNC: {
 			// TODO: handle the different possible error statuses separately
 			if(msg->curl_status == 200){
-				mtx_recv_sync(client, msg);
-				mtx_send_sync(client);
+				cprintf("Sync: %zu bytes\n", sb_count(msg->data) - 1);
+
+				json_val since = JSON_GET(root, JSON_STRING, ("next_batch"));
+				if(since){
+					free(sess->mtx_since);
+					sess->mtx_since = strdup(json_str(since));
+				}
+
+				// get the next long-poll going before processing this batch, so that new
+				// events aren't held at the homeserver while we're busy. We can't receive
+				// its response until this returns, so delivery to IRC stays in order.
+				mtx_send_sync(sess);
+				net_flush();
+
+				mtx_recv_sync(sess, root, msg->user_data);
+			} else if(msg->curl_status == 400 && sess->mtx_since){
+				// our since token has expired (M_UNKNOWN_POS or similar). Start again from a
+				// full-state sync, which mtx_recv_sync diffs against what we already know.
+				net_msg_perror(msg, "SYNC");
+				free(sess->mtx_since);
+				sess->mtx_since = NULL;
+
+				// and don't repeat messages that we've already passed on
+				sess->last_active = MAX(sess->last_active, sess->last_sync);
+
+				mtx_send_sync(sess);
 			} else {
+				// transient failures are retried by net_update, so this is fatal.
 				net_msg_perror(msg, "SYNC");
-				IRC_SEND(client, "NOTICE", client->irc_nick, "Matrix sync failed D:");
-				client->next_sync = now + 10;
+				SESSION_SEND_NUM(sess, "NOTICE", "Matrix sync failed D: Please reconnect.");
+
+				// stop reconnecting clients from resuming this session, see session_find.
+				// Its clients are cut off too, there's nothing more they can do with it.
+				sess->dead = true;
+
+				sb(struct client*) clients = NULL;
+				sb_each(c, sess->clients) sb_push(clients, *c);
+				sb_each(c, clients) client_del(*c);
+				sb_free(clients);
 			}
 		} break;
 
 		case MTX_MSG_MSG: {
-			if(msg->curl_status == 200){
-				yajl_val id = YAJL_GET(root, yajl_t_string, ("event_id"));
-				if(id){
-					sb_push(client->mtx_sent_ids, strdup(id->u.string));
+			size_t txid = (uintptr_t)msg->user_data;
+			json_val id = JSON_GET(root, JSON_STRING, ("event_id"));
+
+			// if the echo already arrived in a sync, there's nothing left to track.
+			sb_each(s, sess->mtx_sent){
+				if(s->txid != txid) continue;
+
+				if(msg->curl_status == 200 && id){
+					s->event_id = strdup(json_str(id));
+				} else {
+					sb_erase(sess->mtx_sent, s - sess->mtx_sent);
 				}
-			} else {
+				break;
+			}
+
+			if(msg->curl_status != 200){
 				net_msg_perror(msg, "MSG");
-				IRC_SEND(client, "NOTICE", client->irc_nick, "Failed to send message.");
+				SESSION_SEND_NUM(sess, "NOTICE", "Failed to send message.");
 			}
 		} break;
 
 		case MTX_MSG_JOIN: {
+			struct room_op* op = msg->user_data;
+
 			if(msg->curl_status == 200){
-				yajl_val room_id = YAJL_GET(root, yajl_t_string, ("room_id"));
+				json_val room_id = JSON_GET(root, JSON_STRING, ("room_id"));
 				if(room_id){
-					cprintf("Joined [%s]\n", room_id->u.string);
-					room_new(id_intern(room_id->u.string));
+					cprintf("Joined [%s]\n", json_str(room_id));
+					op->room = id_intern(json_str(room_id));
+					room_new(op->room);
+
+					// don't wait for the room to turn up in a sync, which could take a while.
+					// the op keeps its slot until the STATE reply is in.
+					mtx_send_state(sess, op);
+					break;
 				}
 			} else {
-				yajl_val err = YAJL_GET(root, yajl_t_string, ("errcode"));
-				// TODO: if this was an auto-join, don't send stuff...
-				//       should user_data be null in this case?
-				if(err){
+				json_val err = JSON_GET(root, JSON_STRING, ("errcode"));
+				net_msg_perror(msg, "JOIN");
+
+				// auto-joins have no one to tell
+				sb_each(s, op->irc_socks){
+					struct client* client = mtx_find_client(sess, *s);
+					if(!client) continue;
+
 					// TODO: can we get M_FORBIDDEN when we're banned too?
-					if(strcmp(err->u.string, "M_FORBIDDEN") == 0){
-						IRC_SEND_NUM(client, "473", msg->user_data, "Cannot join channel (+i)");
+					if(err && strcmp(json_str(err), "M_FORBIDDEN") == 0){
+						IRC_SEND_NUM(client, "473", op->name, "Cannot join channel (+i)");
+					} else if(err && strcmp(json_str(err), "M_NOT_FOUND") == 0){
+						IRC_SEND_NUM(client, "403", op->name, "No such channel.");
 					} else {
-						net_msg_perror(msg, "JOIN");
 						IRC_SEND(client, "NOTICE", client->irc_nick, "Error joining channel");
 					}
 				}
 			}
-			free(msg->user_data);
+
+			sess->room_ops_sent--;
+			mtx_room_op_free(op);
+			mtx_room_ops_pump(sess);
+		} break;
+
+		case MTX_MSG_STATE: {
+			struct room_op* op = msg->user_data;
+
+			// not room_lookup_mtx, it can have been swept while this was in flight since
+			// we aren't a member until mtx_room_joined below.
+			struct room* room = room_new(op->room);
+
+			if(msg->curl_status == 200 && JSON_IS_ARRAY(root)){
+				mtx_room_joined(sess, room);
+
+				// a full-state sync sent before this won't list it, see mtx_recv_sync
+				if(!sess->mtx_since){
+					sb_push(sess->sync_joins, room->id);
+				}
+
+				// the session's clients are all told about this room below, so they get
+				// RPL_TOPIC and NAMES rather than TOPIC / MODE messages.
+				struct sync_state state = {
+					.room    = room,
+					.session = sess,
+					.flags   = SYNC_NEW_ROOM,
+				};
+
+				for(size_t i = 0; i < root->u.array.len; ++i){
+					mtx_event(&state, root->u.array.values[i]);
+				}
+
+				// unlike the sync, this has all of the members
+				room->members_loaded = true;
+
+				// when the room does come through a sync, these clients already have it,
+				// and only the differences are sent, see mtx_recv_sync.
+				sb_each(c, sess->clients){
+					bool requested = false;
+					sb_each(s, op->irc_socks){
+						if(*s == (*c)->irc_sock) requested = true;
+					}
+
+					if(requested || !((*c)->irc_caps & IRC_CAP_LAZY_ATTACH)){
+						irc_attach_room(*c, room);
+					}
+				}
+			} else {
+				// not fatal, the room will be attached when it arrives in a sync.
+				net_msg_perror(msg, "STATE");
+			}
+
+			sess->room_ops_sent--;
+			mtx_room_op_free(op);
+			mtx_room_ops_pump(sess);
 		} break;
 
 		case MTX_MSG_LEAVE: {
+			struct room_op* op = msg->user_data;
+			struct room* room = room_lookup_mtx(op->room);
+			sess->room_ops_sent--;
+
 			if(msg->curl_status == 200){
-				cprintf("TODO: leave ok, tell IRC\n");
+				// the sync will have nothing left to do when it sees we've left
+				if(room) mtx_room_left(sess, room);
 			} else {
-				char* url = NULL;
-				curl_easy_getinfo(msg->curl, CURLINFO_EFFECTIVE_URL, &url);
 				net_msg_perror(msg, "LEAVE");
+
+				sb_each(s, op->irc_socks){
+					struct client* client = mtx_find_client(sess, *s);
+					if(client){
+						IRC_SEND(client, "NOTICE", client->irc_nick, "Error leaving channel");
+					}
+				}
 			}
+
+			mtx_room_op_free(op);
+			mtx_room_ops_pump(sess);
 		} break;
 
 		case MTX_MSG_TOPIC: {
@@ -375,47 +632,88 @@ void mtx_recv(struct client* client, struct net_msg* msg){
 			}
 		} break;
 
-		case MTX_MSG_PM_LOOKUP: {
-			struct pm_data* data = msg->user_data;
-			assert(data);
+		case MTX_MSG_DIRECTORY: {
+			directory_recv(sess, msg, root);
+		} break;
+
+		case MTX_MSG_PROFILE: {
+			profile_recv(sess, msg, root);
+		} break;
 
-			if(msg->curl_status == 200){
-				// TODO: check if room was created in the meantime?
-				mtx_send_pm_create_room(client, data);
-			} else {
-				char* who = cvt_m2i_user(data->friend);
-				*strchrnul(who, '!') = 0;
-				IRC_SEND_NUM(client, "401", who, "No such nick/channel.");
-				free(who);
+		case MTX_MSG_MEMBERS: {
+			struct members_req* req = msg->user_data;
+			struct room* room = room_lookup_mtx(req->room);
+			json_val chunk = JSON_GET(root, JSON_ARRAY, ("chunk"));
 
-				net_msg_perror(msg, "PM_LOOKUP");
+			if(msg->curl_status == 200 && room && chunk){
+				struct sync_state state = {
+					.room    = room,
+					.session = sess,
+				};
+
+				for(size_t i = 0; i < chunk->u.array.len; ++i){
+					mtx_event(&state, chunk->u.array.values[i]);
+				}
+
+				room->members_loaded = true;
+				cprintf("Loaded %zu members for [%s]\n", sb_count(room->members), id_lookup(room->id));
+			} else {
+				net_msg_perror(msg, "MEMBERS");
 			}
-		} break;
 
-		case MTX_MSG_PM_CREATE: {
-			struct pm_data* data = msg->user_data;
-			assert(data);
+			// if it failed, send what we have rather than nothing
+			sb_each(s, req->names_socks){
+				struct client* client = mtx_find_client(sess, *s);
+				if(client && room){
+					irc_send_names(client, room);
+				}
+			}
 
-			yajl_val room = YAJL_GET(root, yajl_t_string, ("room_id"));
-			char buf[256] = "";
+			sb_free(req->names_socks);
+			free(req);
+		} break;
 
+		case MTX_MSG_DIRECT: {
 			if(msg->curl_status == 200){
-				assert(room);
+				direct_update(sess, root);
+				direct_flush(sess, false);
+			} else if(msg->curl_status == 404){
+				// they've never had a DM, which is different from not knowing
+				direct_update(sess, NULL);
+				direct_flush(sess, false);
+			} else {
+				net_msg_perror(msg, "DIRECT");
+				direct_flush(sess, true);
+			}
+		} break;
+
+		case MTX_MSG_DIRECT_SET: {
+			if(msg->curl_status != 200){
+				net_msg_perror(msg, "DIRECT_SET");
+			}
+		} break;
 
-				// TODO: notify of room creation in a nice way
-				//snprintf(buf, sizeof(buf), "Created room [%s]", room->u.string);
-				//IRC_SEND_PF(client, id_lookup(data->friend), SF_CVT_PREFIX, "NOTICE", "bob", buf);
+		case MTX_MSG_PM_CREATE: {
+			mtx_id friend = (uintptr_t)msg->user_data;
+			json_val room = JSON_GET(root, JSON_STRING, ("room_id"));
 
-				struct room* r = room_new(id_intern(room->u.string));
-				mtx_send_msg(client, r, data->message);
+			if(msg->curl_status == 200 && room){
+				// sends the PMs that were waiting on it
+				direct_created(sess, friend, id_intern(json_str(room)));
+				mtx_send_direct_set(sess);
 			} else {
-				// TODO: proper error message
-				snprintf(buf, sizeof(buf), "RIP IN PIECES: [%ld]", msg->curl_status); 
-				IRC_SEND(client, "NOTICE", client->irc_nick, "Error sending PM");
+				direct_created(sess, friend, 0);
 				net_msg_perror(msg, "PM_CREATE");
-			}
 
-			free(data);
+				// the invite is refused for users that don't exist
+				if(msg->curl_status >= 400 && msg->curl_status < 500){
+					char* who = cvt_m2i_user(friend);
+					*strchrnul(who, '!') = 0;
+					SESSION_SEND_NUM(sess, "401", who, "No such nick/channel.");
+				} else {
+					SESSION_SEND_NUM(sess, "NOTICE", "Error sending PM");
+				}
+			}
 		} break;
 
 		default: {
@@ -423,84 +721,102 @@ void mtx_recv(struct client* client, struct net_msg* msg){
 		} break;
 	}
 
-	yajl_tree_free(root);
+	json_free(root);
 }
 
-void mtx_send_login(struct client* client){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_LOGIN);
+void mtx_send_login(struct session* sess, const char* user, const char* pass){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_LOGIN);
 	
 	char* url;
 	asprintf(&url, "%s" MTX_CLIENT "/login", global.mtx_server_base_url);
 	curl_easy_setopt(msg->curl, CURLOPT_URL, url);
 	free(url);
 
-	assert(client->irc_user);
-	assert(client->irc_pass);
-
-	char* json = NULL;
-	yajl_generate(
-		&json,
+	const char* json = JSON_TMPL(
 		"{ "
 		"'type': 'm.login.password', "
 		"'user': %s, 'password': %s, "
 		"'device_id': %s, "
 		"'initial_device_display_name': %s, "
 		"}",
-		client->irc_nick,
-		client->irc_pass,
+		user,
+		pass,
 		global.device_id,
 		global.device_name
 	);
 
 	curl_easy_setopt(msg->curl, CURLOPT_COPYPOSTFIELDS, json);
-	free(json);
-
-	{
-		volatile char *p = client->irc_pass;
-		while(*p) *p++ = 0;
-		free(client->irc_pass);
-		client->irc_pass = NULL;
-	}
 
 	net_msg_send(msg);
 }
 
-void mtx_send_logout(struct client* client){
+void mtx_send_logout(struct session* sess){
 
 }
 
-void mtx_send_sync(struct client* client){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_SYNC);
+static void mtx_send_filter(struct session* sess){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_FILTER);
 
-	char* filter = curl_easy_escape(
-		msg->curl,
-		"{ \"room\": { \"ephemeral\": { \"not_types\": [ \"*\" ] }}}",
-		0
-	);
+	char* u = curl_easy_escape(msg->curl, id_lookup(sess->mtx_id), 0);
+	MTX_SET_URL(sess, msg, "/user/%s/filter", u);
+	curl_free(u);
+
+	char* json = mtx_event_filter();
+	curl_easy_setopt(msg->curl, CURLOPT_COPYPOSTFIELDS, json);
+	free(json);
+
+	net_msg_send(msg);
+}
+
+void mtx_send_sync(struct session* sess){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_SYNC);
+	msg->user_data = (void*)(uintptr_t)!sess->mtx_since; // whether it's a full-state sync
 
-	// XXX: I would like to poll for longer, but anything over ~60s seems to time out with nginx
+	// this one will have the rooms joined before now in it
+	if(!sess->mtx_since){
+		sb_free(sess->sync_joins);
+	}
+
+	// only used if registering the filter failed
+	static char* inline_filter;
+
+	const char* filter = sess->mtx_filter;
+	if(!filter){
+		if(!inline_filter){
+			char* json = mtx_event_filter();
+			inline_filter = curl_easy_escape(msg->curl, json, 0);
+			free(json);
+		}
+		filter = inline_filter;
+	}
 
 	char* url;
 	asprintf(
 		&url,
-		"%s" MTX_CLIENT "/sync?timeout=55000%s%s&access_token=%s&filter=%s",
+		"%s" MTX_CLIENT "/sync?timeout=%d%s%s&access_token=%s&filter=%s",
 		global.mtx_server_base_url,
-		client->mtx_since ? "&since=" : "&full_state=true",
-		client->mtx_since ?: "",
-		client->mtx_token,
+		MTX_SYNC_POLL_MS,
+		sess->mtx_since ? "&since=" : "&full_state=true",
+		sess->mtx_since ?: "",
+		sess->mtx_token,
 		filter
 	);
 
-	curl_free(filter);
 	curl_easy_setopt(msg->curl, CURLOPT_URL, url);
 	free(url);
 
 	net_msg_send(msg);
 }
 
-void mtx_send_msg(struct client* client, struct room* room, const char* user_msg){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_MSG);
-	MTX_SET_URL(client, msg, "/rooms/%s/send/m.room.message/%zu", id_lookup(room->id), client->mtx_txid++);
+void mtx_send_msg(struct session* sess, struct client* from, struct room* room, const char* user_msg){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_MSG);
+	size_t txid = sess->mtx_txid++;
+
+	MTX_SET_URL(sess, msg, "/rooms/%s/send/m.room.message/%zu", id_lookup(room->id), txid);
+
+	struct sent_msg sent = { .txid = txid, .client = from };
+	sb_push(sess->mtx_sent, sent);
+	msg->user_data = (void*)(uintptr_t)txid;
 
 	bool is_emote = false;
 	if(strncmp(user_msg, "\001ACTION ", 8) == 0){
@@ -518,9 +834,7 @@ void mtx_send_msg(struct client* client, struct room* room, const char* user_msg
 
 	curl_easy_setopt(msg->curl, CURLOPT_CUSTOMREQUEST, "PUT");
 
-	char* json = NULL;
-	yajl_generate(
-		&json,
+	const char* json = JSON_TMPL(
 		"{ "
 		"'msgtype': %s, "
 		"'body': %z, "
@@ -534,7 +848,6 @@ void mtx_send_msg(struct client* client, struct room* room, const char* user_msg
 
 	cprintf("MSG JSON = [%s]\n", json);
 	curl_easy_setopt(msg->curl, CURLOPT_COPYPOSTFIELDS, json);
-	free(json);
 
 	sb_free(html);
 	sb_free(stripped);
@@ -542,19 +855,17 @@ void mtx_send_msg(struct client* client, struct room* room, const char* user_msg
 	net_msg_send(msg);
 }
 
-void mtx_send_topic(struct client* client, struct room* room, const char* topic){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_TOPIC);
-	MTX_SET_URL(client, msg, "/rooms/%s/send/m.room.topic/%zu", id_lookup(room->id), client->mtx_txid++);
+void mtx_send_topic(struct session* sess, struct room* room, const char* topic){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_TOPIC);
+	MTX_SET_URL(sess, msg, "/rooms/%s/send/m.room.topic/%zu", id_lookup(room->id), sess->mtx_txid++);
 	curl_easy_setopt(msg->curl, CURLOPT_CUSTOMREQUEST, "PUT");
 
 	// TODO: can this do html colour stuff?
 	sb(char) stripped = NULL;
 	sb(char) html = cvt_i2m_msg(topic, &stripped);
 
-	char* json = NULL;
-	yajl_generate(&json, "{ 'topic': %z }", sb_count(stripped), stripped);
+	const char* json = JSON_TMPL("{ 'topic': %z }", sb_count(stripped), stripped);
 	curl_easy_setopt(msg->curl, CURLOPT_COPYPOSTFIELDS, json);
-	free(json);
 
 	sb_free(html);
 	sb_free(stripped);
@@ -562,17 +873,16 @@ void mtx_send_topic(struct client* client, struct room* room, const char* topic)
 	net_msg_send(msg);
 }
 
-void mtx_send_join(struct client* client, const char* room){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_JOIN);
-	assert(room);
+static void mtx_send_room_join(struct session* sess, struct room_op* op){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_JOIN);
+	msg->user_data = op;
 
-	char* r = curl_easy_escape(msg->curl, room, 0);
+	char* r = curl_easy_escape(msg->curl, op->name, 0);
 
-	if(room[0] == '#'){
-		msg->user_data = strdup(room);
-		MTX_SET_URL(client, msg, "/join/%s%%3A%s", r, client->mtx_server);
-	} else if(room[0] == '!'){ // XXX: what happens if we get a ! join to a different host?
-		MTX_SET_URL(client, msg, "/join/%s", r);
+	if(op->name[0] == '#'){
+		MTX_SET_URL(sess, msg, "/join/%s%%3A%s", r, sess->mtx_server);
+	} else if(op->name[0] == '!'){ // XXX: what happens if we get a ! join to a different host?
+		MTX_SET_URL(sess, msg, "/join/%s", r);
 	}
 
 	curl_easy_setopt(msg->curl, CURLOPT_POSTFIELDS, "{}");
@@ -581,13 +891,13 @@ void mtx_send_join(struct client* client, const char* room){
 	net_msg_send(msg);
 }
 
-void mtx_send_leave(struct client* client, struct room* room){
-	assert(room->id);
+static void mtx_send_room_leave(struct session* sess, struct room_op* op){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_LEAVE);
+	msg->user_data = op;
 
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_LEAVE);
-	char* r = curl_easy_escape(msg->curl, id_lookup(room->id), 0);
+	char* r = curl_easy_escape(msg->curl, id_lookup(op->room), 0);
 
-	MTX_SET_URL(client, msg, "/rooms/%s/leave", r);
+	MTX_SET_URL(sess, msg, "/rooms/%s/leave", r);
 	curl_easy_setopt(msg->curl, CURLOPT_POSTFIELDS, "{}");
 
 	// TODO: should we call /forget too?
@@ -596,38 +906,234 @@ void mtx_send_leave(struct client* client, struct room* room){
 	net_msg_send(msg);
 }
 
-void mtx_send_pm_setup(struct client* client, mtx_id mtx_user, const char* text){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_PM_LOOKUP);
+static void mtx_send_state(struct session* sess, struct room_op* op){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_STATE);
+	msg->user_data = op;
+
+	char* r = curl_easy_escape(msg->curl, id_lookup(op->room), 0);
+	MTX_SET_URL(sess, msg, "/rooms/%s/state", r);
+	curl_free(r);
+
+	net_msg_send(msg);
+}
+
+static void mtx_room_ops_pump(struct session* sess){
+	while(sess->room_ops_sent < MTX_ROOM_OPS_MAX && sb_count(sess->room_ops)){
+		struct room_op* op = sess->room_ops[0];
+		sb_erase(sess->room_ops, 0);
+		sess->room_ops_sent++;
+
+		if(op->type == MTX_MSG_JOIN){
+			mtx_send_room_join(sess, op);
+		} else {
+			mtx_send_room_leave(sess, op);
+		}
+	}
+}
+
+static bool mtx_room_op_match(struct room_op* op, int type, const char* name, mtx_id room){
+	if(op->type != type) return false;
+	return room ? op->room == room : strcasecmp(op->name, name) == 0;
+}
+
+static void mtx_room_op_queue(struct session* sess, struct client* from, int type, const char* name, mtx_id room){
+	struct room_op* op = NULL;
+
+	// if the same thing is already queued or in flight, just wait on that instead
+	sb_each(o, sess->room_ops){
+		if(mtx_room_op_match(*o, type, name, room)){
+			op = *o;
+			break;
+		}
+	}
+
+	for(struct net_msg* m = sess->msgs; m && !op; m = m->next){
+		if(m->type != MTX_MSG_JOIN && m->type != MTX_MSG_STATE && m->type != MTX_MSG_LEAVE) continue;
+		if(mtx_room_op_match(m->user_data, type, name, room)){
+			op = m->user_data;
+		}
+	}
+
+	if(!op){
+		op = calloc(1, sizeof(*op) + strlen(name) + 1);
+		op->type = type;
+		op->room = room;
+		strcpy(op->name, name);
+		sb_push(sess->room_ops, op);
+	}
+
+	if(from){
+		bool found = false;
+		sb_each(s, op->irc_socks){
+			if(*s == from->irc_sock) found = true;
+		}
+		if(!found){
+			sb_push(op->irc_socks, from->irc_sock);
+		}
+	}
+
+	mtx_room_ops_pump(sess);
+}
+
+void mtx_send_join(struct session* sess, struct client* from, const char* room){
+	assert(room);
+	mtx_room_op_queue(sess, from, MTX_MSG_JOIN, room, 0);
+}
+
+void mtx_send_leave(struct session* sess, struct client* from, struct room* room){
+	assert(room->id);
+	mtx_room_op_queue(sess, from, MTX_MSG_LEAVE, id_lookup(room->id), room->id);
+}
+
+void mtx_room_op_free(struct room_op* op){
+	if(!op) return;
+	sb_free(op->irc_socks);
+	free(op);
+}
+
+// for requests that will never get to mtx_recv, which is what frees their user_data.
+void mtx_msg_abandon(struct net_msg* msg){
+	switch(msg->type){
+		case MTX_MSG_JOIN:
+		case MTX_MSG_STATE:
+		case MTX_MSG_LEAVE:
+			mtx_room_op_free(msg->user_data);
+			break;
+		case MTX_MSG_MEMBERS: {
+			struct members_req* req = msg->user_data;
+			sb_free(req->names_socks);
+			free(req);
+		} break;
+	}
+	msg->user_data = NULL;
+}
+
+// fetches the room's full member list, and sends NAMES to names_to (if not NULL) once
+// it's arrived. Clients asking while it's already being fetched share that request.
+void mtx_send_members(struct session* sess, struct room* room, struct client* names_to){
+	struct members_req* req = NULL;
+
+	for(struct net_msg* m = sess->msgs; m; m = m->next){
+		if(m->type == MTX_MSG_MEMBERS && ((struct members_req*)m->user_data)->room == room->id){
+			req = m->user_data;
+			break;
+		}
+	}
+
+	if(req){
+		if(names_to){
+			sb_each(s, req->names_socks){
+				if(*s == names_to->irc_sock) return;
+			}
+			sb_push(req->names_socks, names_to->irc_sock);
+		}
+		return;
+	}
+
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_MEMBERS);
+
+	req = calloc(1, sizeof(*req));
+	req->room = room->id;
+	if(names_to){
+		sb_push(req->names_socks, names_to->irc_sock);
+	}
+	msg->user_data = req;
+
+	char* r = curl_easy_escape(msg->curl, id_lookup(room->id), 0);
+	MTX_SET_URL(sess, msg, "/rooms/%s/members", r);
+	curl_free(r);
+
+	net_msg_send(msg);
+}
+
+// fetches one page of the public room directory, see directory_recv
+void mtx_send_directory(struct session* sess, const char* since, uint32_t generation){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_DIRECTORY);
+	msg->user_data = (void*)(uintptr_t)generation;
 
-	struct pm_data* data = malloc(sizeof(*data) + strlen(text) + 1);
-	data->friend = mtx_user;
-	strcpy(data->message, text);
-	msg->user_data = data;
+	char* s = since ? curl_easy_escape(msg->curl, since, 0) : NULL;
+	char* url;
+	assert(asprintf(&url, "%s" MTX_CLIENT "/publicRooms?limit=500%s%s&access_token=%s", global.mtx_server_base_url, s ? "&since=" : "", s ? s : "", sess->mtx_token) != -1);
+	curl_easy_setopt(msg->curl, CURLOPT_URL, url);
+	free(url);
+	curl_free(s);
 
-	char* u = curl_easy_escape(msg->curl, id_lookup(mtx_user), 0);
-	MTX_SET_URL(client, msg, "/profile/%s", u);
+	net_msg_send(msg);
+}
 
+void mtx_send_profile(struct session* sess, mtx_id user){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_PROFILE);
+	msg->user_data = (void*)(uintptr_t)user;
+
+	char* u = curl_easy_escape(msg->curl, id_lookup(user), 0);
+	MTX_SET_URL(sess, msg, "/profile/%s", u);
 	curl_free(u);
+
 	net_msg_send(msg);
 }
 
-static void mtx_send_pm_create_room(struct client* client, struct pm_data* data){
-	struct net_msg* msg = net_msg_new(client, MTX_MSG_PM_CREATE);
-	msg->user_data = data;
+// PMs someone we don't have a room with yet. The room is only created once,
+// anything sent to them in the meantime waits for it, see direct_queue.
+void mtx_send_pm(struct session* sess, mtx_id mtx_user, const char* text){
+	// until m.direct is loaded, we could make a second room and then overwrite m.direct
+	// with just that one, so the PM waits for it, see direct_flush.
+	if(!direct_loaded(sess)){
+		if(direct_defer(sess, mtx_user, text)){
+			mtx_send_direct(sess);
+		}
+		return;
+	}
+
+	if(!direct_queue(sess, mtx_user, text)){
+		mtx_send_pm_create_room(sess, mtx_user);
+	}
+}
+
+static void mtx_send_pm_create_room(struct session* sess, mtx_id user){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_PM_CREATE);
+	msg->user_data = (void*)(uintptr_t)user;
 
-	MTX_SET_URL(client, msg, "/createRoom");
+	MTX_SET_URL(sess, msg, "/createRoom");
 
-	char* json = NULL;
-	yajl_generate(
-		&json,
+	const char* json = JSON_TMPL(
 		"{ "
-		"'preset': 'private_chat', "
+		"'preset': 'trusted_private_chat', "
+		"'is_direct': true, "
 		"'creation_content': { 'm.federate': false }, "
 		"'invite': [ %s ], "
 		"}",
-		id_lookup(data->friend)
+		id_lookup(user)
 	);
 
-	curl_easy_setopt(msg->curl, CURLOPT_POSTFIELDS, json);
+	curl_easy_setopt(msg->curl, CURLOPT_COPYPOSTFIELDS, json);
+
+	net_msg_send(msg);
+}
+
+static void mtx_send_direct(struct session* sess){
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_DIRECT);
+
+	char* u = curl_easy_escape(msg->curl, id_lookup(sess->mtx_id), 0);
+	MTX_SET_URL(sess, msg, "/user/%s/account_data/m.direct", u);
+	curl_free(u);
+
+	net_msg_send(msg);
+}
+
+static void mtx_send_direct_set(struct session* sess){
+	// never from an index that hasn't loaded, it'd replace every DM the user has
+	if(!direct_loaded(sess)) return;
+
+	struct net_msg* msg = net_msg_new(sess, MTX_MSG_DIRECT_SET);
+
+	char* u = curl_easy_escape(msg->curl, id_lookup(sess->mtx_id), 0);
+	MTX_SET_URL(sess, msg, "/user/%s/account_data/m.direct", u);
+	curl_free(u);
+
+	char* json = direct_json(sess);
+	curl_easy_setopt(msg->curl, CURLOPT_CUSTOMREQUEST, "PUT");
+	curl_easy_setopt(msg->curl, CURLOPT_COPYPOSTFIELDS, json);
+	free(json);
+
 	net_msg_send(msg);
 }
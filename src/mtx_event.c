@@ -1,48 +1,235 @@
-#include <yajl/yajl_tree.h>
 #include <yajl/yajl_gen.h>
 #include <string.h>
 #include <stdbool.h>
 #include "morpheus.h"
 
-static void mtx_event_message(struct sync_state* state, yajl_val obj){
+// Every event field read by the handlers below (and the presence ones read by
+// mtx_recv_sync), as X(name, type, path). The paths are in the sync filter's
+// event_fields syntax, which also asks the homeserver to leave everything else out.
+// A literal '.' in a key is written as "\\.".
+#define MTX_EVENT_FIELDS(X) \
+	X(type           , STR, "type"                                    ) \
+	X(sender         , STR, "sender"                                  ) \
+	X(state_key      , STR, "state_key"                               ) \
+	X(event_id       , STR, "event_id"                                ) \
+	X(ts             , INT, "origin_server_ts"                        ) \
+	X(txn_id         , STR, "unsigned.transaction_id"                 ) \
+	X(msgtype        , STR, "content.msgtype"                         ) \
+	X(body           , STR, "content.body"                            ) \
+	X(format         , STR, "content.format"                          ) \
+	X(formatted_body , STR, "content.formatted_body"                  ) \
+	X(url            , STR, "content.url"                             ) \
+	X(mimetype       , STR, "content.info.mimetype"                   ) \
+	X(topic          , STR, "content.topic"                           ) \
+	X(membership     , STR, "content.membership"                      ) \
+	X(displayname    , STR, "content.displayname"                     ) \
+	X(avatar_url     , STR, "content.avatar_url"                      ) \
+	X(kind           , STR, "content.kind"                            ) \
+	X(join_rule      , STR, "content.join_rule"                       ) \
+	X(aliases        , ARR, "content.aliases"                         ) \
+	X(alias          , STR, "content.alias"                           ) \
+	X(users          , OBJ, "content.users"                           ) \
+	X(users_default  , INT, "content.users_default"                   ) \
+	X(power_level    , INT, "content.events.m\\.room\\.power_levels"  ) \
+	X(state_default  , INT, "content.state_default"                   ) \
+	X(kick           , INT, "content.kick"                            ) \
+	X(name           , STR, "content.name"                            ) \
+	X(presence       , STR, "content.presence"                        ) \
+	X(last_active_ago, INT, "content.last_active_ago"                 )
+
+typedef const char* mtx_ev_STR;
+typedef long long   mtx_ev_INT;
+typedef json_val    mtx_ev_OBJ;
+typedef json_val    mtx_ev_ARR;
+
+enum {
+#define X(name, type, path) MTX_EV_##name,
+	MTX_EVENT_FIELDS(X)
+#undef X
+	MTX_EV_COUNT
+};
+
+// An event, decoded from its JSON in one pass over the keys. Fields that were
+// missing (or the wrong type) are NULL, or not in has for the integers.
+struct mtx_ev {
+	uint64_t has;
+#define X(name, type, path) mtx_ev_##type name;
+	MTX_EVENT_FIELDS(X)
+#undef X
+};
+
+#define MTX_EV_HAS(ev, field) ((ev)->has & (1ULL << MTX_EV_##field))
+
+enum {
+	MTX_EV_T_STR,
+	MTX_EV_T_INT,
+	MTX_EV_T_OBJ,
+	MTX_EV_T_ARR,
+};
+
+static const struct mtx_ev_field {
+	int         type;
+	size_t      offset;
+	const char* path;
+} mtx_ev_fields[] = {
+#define X(name, t, p) { MTX_EV_T_##t, offsetof(struct mtx_ev, name), p },
+	MTX_EVENT_FIELDS(X)
+#undef X
+};
+
+_Static_assert(MTX_EV_COUNT <= 64, "struct mtx_ev.has is too small");
+
+// The paths above as a tree of keys, one level per object that has fields we want.
+struct mtx_ev_key {
+	char* key;
+	int   field; // or -1
+	int   child; // level, or -1
+};
+
+static sb(sb(struct mtx_ev_key)) mtx_ev_levels;
+
+static int mtx_ev_key_get(int level, const char* key){
+	sb_each(k, mtx_ev_levels[level]){
+		if(strcmp(k->key, key) == 0) return k - mtx_ev_levels[level];
+	}
+
+	sb_push(mtx_ev_levels[level], ((struct mtx_ev_key){ strdup(key), -1, -1 }));
+	return sb_count(mtx_ev_levels[level]) - 1;
+}
+
+static void mtx_ev_levels_init(void){
+	sb_push(mtx_ev_levels, NULL);
+
+	for(size_t i = 0; i < countof(mtx_ev_fields); ++i){
+		const char* p = mtx_ev_fields[i].path;
+		int level = 0;
+
+		for(;;){
+			char seg[64];
+			size_t n = 0;
+
+			for(; *p && *p != '.' && n < sizeof(seg) - 1; ++p){
+				if(*p == '\\' && p[1]) ++p;
+				seg[n++] = *p;
+			}
+			seg[n] = '\0';
+
+			int k = mtx_ev_key_get(level, seg);
+
+			if(!*p){
+				mtx_ev_levels[level][k].field = i;
+				break;
+			}
+
+			if(mtx_ev_levels[level][k].child == -1){
+				mtx_ev_levels[level][k].child = sb_count(mtx_ev_levels);
+				sb_push(mtx_ev_levels, NULL);
+			}
+
+			level = mtx_ev_levels[level][k].child;
+			++p;
+		}
+	}
+}
+
+static void mtx_ev_set(struct mtx_ev* ev, int field, json_val v){
+	const struct mtx_ev_field* f = mtx_ev_fields + field;
+	void* dst = (char*)ev + f->offset;
+
+	switch(f->type){
+		case MTX_EV_T_STR:
+			if(JSON_IS_STRING(v)) *(const char**)dst = json_str(v);
+			break;
+		case MTX_EV_T_INT:
+			if(JSON_IS_INTEGER(v)){
+				*(long long*)dst = v->u.number.i;
+				ev->has |= 1ULL << field;
+			}
+			break;
+		case MTX_EV_T_OBJ:
+			if(JSON_IS_OBJECT(v)) *(json_val*)dst = v;
+			break;
+		case MTX_EV_T_ARR:
+			if(JSON_IS_ARRAY(v)) *(json_val*)dst = v;
+			break;
+	}
+}
+
+static void mtx_ev_decode(struct mtx_ev* ev, int level, json_val obj){
+	sb(struct mtx_ev_key) keys = mtx_ev_levels[level];
+
+	for(size_t i = 0; i < obj->u.object.len; ++i){
+		const char* key = obj->u.object.keys[i];
+
+		sb_each(k, keys){
+			if(k->key[0] != key[0] || strcmp(k->key, key) != 0) continue;
+
+			json_val v = obj->u.object.values[i];
+			if(k->child != -1){
+				if(JSON_IS_OBJECT(v)) mtx_ev_decode(ev, k->child, v);
+			} else {
+				mtx_ev_set(ev, k->field, v);
+			}
+			break;
+		}
+	}
+}
 
-	yajl_val type   = YAJL_GET(obj, yajl_t_string, ("content", "msgtype"));
-	yajl_val body   = YAJL_GET(obj, yajl_t_string, ("content", "body"));
-	yajl_val fmt    = YAJL_GET(obj, yajl_t_string, ("content", "format"));
-	yajl_val fbody  = YAJL_GET(obj, yajl_t_string, ("content", "formatted_body"));
-	yajl_val sender = YAJL_GET(obj, yajl_t_string, ("sender"));
-	yajl_val id     = YAJL_GET(obj, yajl_t_string, ("event_id"));
-	yajl_val ts     = YAJL_GET(obj, yajl_t_number, ("origin_server_ts"));
+static void mtx_event_message(struct sync_state* state, struct mtx_ev* ev){
 
-	if(YAJL_IS_INTEGER(ts) && (ts->u.number.i / 1000) < state->client->last_active){
+	const char* type   = ev->msgtype;
+	const char* sender = ev->sender;
+
+	if(MTX_EV_HAS(ev, ts) && (ev->ts / 1000) < state->session->last_active){
 		// They've probably already seen this message, skip it
 		return;
 	}
 
+	// the sync can overtake the response to our PUT, in which case we won't know the
+	// event_id yet, but the homeserver tells us the transaction id for our own events.
 	bool our_msg = false;
-	if(id){
-		sb_each(i, state->client->mtx_sent_ids){
-			if(strcmp(*i, id->u.string) == 0){
-				our_msg = true;
-				free(*i);
-				sb_erase(state->client->mtx_sent_ids, i - state->client->mtx_sent_ids);
-				break;
-			}
+	struct client* origin = NULL;
+	char* txn_end = NULL;
+	size_t txid = ev->txn_id ? strtoul(ev->txn_id, &txn_end, 10) : 0;
+	bool txn_valid = ev->txn_id && txn_end != ev->txn_id && !*txn_end;
+
+	sb_each(s, state->session->mtx_sent){
+		if((txn_valid && s->txid == txid) || (ev->event_id && s->event_id && strcmp(s->event_id, ev->event_id) == 0)){
+			our_msg = true;
+			origin = s->client;
+			free(s->event_id);
+			sb_erase(state->session->mtx_sent, s - state->session->mtx_sent);
+			break;
 		}
 	}
 
+	// in large rooms, people only appear in the nick list once they say something.
+	// Every session sees this message, the first one to do so shows the JOIN to all.
+	if(sender && (state->flags & SYNC_TIMELINE) && room_is_large(state->room) && room_touch_active(state->room, id_intern(sender))){
+		struct member* m = room_member_get(state->room, id_intern(sender));
+		char* irc_room = NULL;
+
+		if(m && !room_member_prefix(state->room, m->power) && room_get_irc_info(state->room, state->session, &irc_room) == ROOM_IRC_CHANNEL){
+			SESSION_BROADCAST_PF(NULL, state->room, sender, SF_CVT_PREFIX, "JOIN", irc_room);
+		}
+	}
+
+	if(state->flags & SYNC_DETACHED) return;
+
 	char* room_name = NULL;
-	room_get_irc_info(state->room, state->client, &room_name);
+	room_get_irc_info(state->room, state->session, &room_name);
 
-	if(!our_msg && type && body && sender){
+	// other clients on the session haven't seen what this one said, so they still get it.
+	// If the one that sent it has gone (origin is NULL), all of them get it.
+	if(type && ev->body && sender){
 
-		char* body_str;
+		const char* body_str;
 		bool rich;
-		if(fmt && strcmp(fmt->u.string, "org.matrix.custom.html") == 0 && fbody){
-			body_str = fbody->u.string;
+		if(ev->format && strcmp(ev->format, "org.matrix.custom.html") == 0 && ev->formatted_body){
+			body_str = ev->formatted_body;
 			rich = true;
 		} else {
-			body_str = body->u.string;
+			body_str = ev->body;
 			rich = false;
 		}
 
@@ -52,28 +239,26 @@ static void mtx_event_message(struct sync_state* state, yajl_val obj){
 
 		// TODO: m.location
 
-		char* msg = NULL;
-		bool is_notice = strcmp(type->u.string, "m.notice") == 0;
+		const char* msg = NULL;
+		bool is_notice = strcmp(type, "m.notice") == 0;
 
-		if(is_notice || strcmp(type->u.string, "m.text") == 0){
-			msg = strdup(body_str);
-		} else if(strcmp(type->u.string, "m.emote") == 0){
-			asprintf(&msg, "\001ACTION %s\001", body_str);
+		if(is_notice || strcmp(type, "m.text") == 0){
+			msg = body_str;
+		} else if(strcmp(type, "m.emote") == 0){
+			msg = scratch_printf("\001ACTION %s\001", body_str);
 		} else {
+			const char* media_url  = ev->url;
+			const char* media_mime = ev->mimetype;
 
-			yajl_val media_url  = YAJL_GET(obj, yajl_t_string, ("content", "url"));
-			yajl_val media_mime = YAJL_GET(obj, yajl_t_string, ("content", "info", "mimetype"));
-
-			if(media_url && media_mime && strncmp(media_url->u.string, "mxc://", 6) == 0){
+			if(media_url && media_mime && strncmp(media_url, "mxc://", 6) == 0){
 				for(size_t i = 0; i < countof(msgtypes); ++i){
-					if(strcmp(type->u.string, msgtypes[i]) == 0){
-						asprintf(
-							&msg,
+					if(strcmp(type, msgtypes[i]) == 0){
+						msg = scratch_printf(
 							"\002[\0039%s\003]\002 %s: %s/_matrix/media/r0/download/%s",
-							media_mime->u.string,
+							media_mime,
 							body_str,
 							global.mtx_server_base_url,
-							media_url->u.string + 6
+							media_url + 6
 						);
 						break;
 					}
@@ -82,175 +267,232 @@ static void mtx_event_message(struct sync_state* state, yajl_val obj){
 		}
 
 		if(msg){
-			sb(char) msg_converted = rich ? cvt_m2i_msg_rich(msg) : cvt_m2i_msg_plain(msg);
+			char* msg_converted = rich ? cvt_m2i_msg_rich(msg) : cvt_m2i_msg_plain(msg);
 
 			struct irc_msg irc_msg = {
 				.cmd = is_notice ? "NOTICE" : "PRIVMSG",
-				.prefix = sender->u.string,
+				.prefix = sender,
 				.params = {
 					room_name,
 					msg_converted,
 				},
 				.pcount = 2,
-				.flags = SF_CVT_PREFIX
+				.flags = SF_CVT_PREFIX | SF_BACKLOG
 			};
 
+			// always tagged, since it might be replayed from the backlog much later.
+			// irc_format leaves it out for clients without server-time.
 			char time_buf[64] = "";
-			if((state->client->irc_caps & IRC_CAP_SERVER_TIME) && ts){
-				time_t t = ts->u.number.i / 1000;
-				struct tm tm = {};
-				gmtime_r(&t, &tm);
-				strftime(time_buf, sizeof(time_buf), "time=%Y-%m-%dT%T.000Z", &tm);
-				irc_msg.tags = time_buf;
+			time_t t = MTX_EV_HAS(ev, ts) ? ev->ts / 1000 : time(0);
+			struct tm tm = {};
+			gmtime_r(&t, &tm);
+			strftime(time_buf, sizeof(time_buf), "time=%Y-%m-%dT%T.000Z", &tm);
+			irc_msg.tags = time_buf;
+
+			if(our_msg){
+				session_send_except(state->session, origin, state->room, &irc_msg);
+			} else {
+				session_send(state->session, state->room, &irc_msg);
 			}
-
-			irc_send(state->client, &irc_msg);
-			sb_free(msg_converted);
-			free(msg);
 		}
 	}
-
-	free(room_name);
 }
 
-static void mtx_event_topic(struct sync_state* state, yajl_val obj){
+static void mtx_event_topic(struct sync_state* state, struct mtx_ev* ev){
 	if(state->flags & SYNC_INVITE) return;
 
-	if(state->flags & SYNC_NEW_ROOM){
-		state->new_topic = obj;
-	} else {
-		yajl_val topic  = YAJL_GET(obj, yajl_t_string, ("content", "topic"));
-		yajl_val sender = YAJL_GET(obj, yajl_t_string, ("sender"));
-
-		char* irc_room = NULL;
-		if(topic && sender && room_get_irc_info(state->room, state->client, &irc_room) != ROOM_IRC_INVALID){
-			IRC_SEND_PF(
-				state->client,
-				sender->u.string,
-				SF_CVT_PREFIX,
-				"TOPIC",
-				irc_room,
-				topic->u.string
-			);
-			free(irc_room);
-		}
+	const char* topic  = ev->topic;
+	const char* sender = ev->sender;
+
+	if(!topic || !sender) return;
+
+	// full-state syncs and other sessions in the room send us topics we already have
+	bool changed = !state->room->topic || strcmp(state->room->topic, topic) != 0;
+
+	// kept so that it can be sent when a client joins later (RPL_TOPIC)
+	free(state->room->topic);
+	state->room->topic        = strdup(topic);
+	state->room->topic_setter = id_intern(sender);
+	state->room->topic_time   = MTX_EV_HAS(ev, ts) ? ev->ts / 1000 : 0;
+
+	char* irc_room = NULL;
+	if(changed && room_get_irc_info(state->room, state->session, &irc_room) > ROOM_IRC_QUERY){
+		// clients that are new to the room get an RPL_TOPIC instead
+		SESSION_BROADCAST_PF(
+			(state->flags & SYNC_NEW_ROOM) ? state->session : NULL,
+			state->room,
+			sender,
+			SF_CVT_PREFIX,
+			"TOPIC",
+			irc_room,
+			topic
+		);
 	}
 }
 
-static void mtx_event_member(struct sync_state* state, yajl_val obj){
-	yajl_val membership = YAJL_GET(obj, yajl_t_string, ("content", "membership"));
-	yajl_val member     = YAJL_GET(obj, yajl_t_string, ("state_key"));
-	yajl_val kind       = YAJL_GET(obj, yajl_t_string, ("content", "kind"));
+static void mtx_event_member(struct sync_state* state, struct mtx_ev* ev){
+	const char* membership = ev->membership;
+	const char* member     = ev->state_key;
 
-	if(kind && strcmp(kind->u.string, "guest") == 0) return;
+	if(ev->kind && strcmp(ev->kind, "guest") == 0) return;
 
 	if(member && membership){
-		mtx_id member_id = id_intern(member->u.string);
+		mtx_id member_id = id_intern(member);
+
+		struct member* old = room_member_get(state->room, member_id);
+		bool was_joined = old && old->state == MEMBER_STATE_JOINED;
 
-		if(strcmp(membership->u.string, "join") == 0){
-			struct member* m = room_member_add(state->room, member_id, MEMBER_STATE_JOINED);
+		// only the timeline has real changes, the state section also has members that
+		// lazy-loading is only now telling us about. We see our own membership change
+		// through the rooms we're given in the sync, see mtx_recv_sync.
+		bool show = (state->flags & SYNC_TIMELINE) && member_id != state->session->mtx_id;
+		bool large = room_is_large(state->room);
+
+		if(strcmp(membership, "join") == 0){
+			room_member_add(state->room, member_id, MEMBER_STATE_JOINED);
+			profile_update(member_id, ev->displayname, ev->avatar_url);
 			char* irc_room = NULL;
 
-			if((state->flags & SYNC_TIMELINE) && m->id != state->client->mtx_id && room_get_irc_info(state->room, state->client, &irc_room) > ROOM_IRC_QUERY){
-				IRC_SEND_PF(state->client, member->u.string, SF_CVT_PREFIX, "JOIN", irc_room);
+			// large rooms wait until they speak, see mtx_event_message
+			if(show && !large && !was_joined && room_get_irc_info(state->room, state->session, &irc_room) > ROOM_IRC_QUERY){
+				SESSION_BROADCAST_PF(NULL, state->room, member, SF_CVT_PREFIX, "JOIN", irc_room);
+			}
+		} else if(strcmp(membership, "leave") == 0 || strcmp(membership, "ban") == 0){
+			char* irc_room = NULL;
+			bool shown = room_drop_active(state->room, member_id) || !large || (old && room_member_prefix(state->room, old->power));
+
+			if(show && shown && was_joined && room_get_irc_info(state->room, state->session, &irc_room) > ROOM_IRC_QUERY){
+				SESSION_BROADCAST_PF(NULL, state->room, member, SF_CVT_PREFIX, "PART", irc_room);
 			}
-			free(irc_room);
 
-		} else if(strcmp(membership->u.string, "leave") == 0){
 			room_member_del(state->room, member_id);
-		} else if(strcmp(membership->u.string, "invite") == 0){
+		} else if(strcmp(membership, "invite") == 0){
 			room_member_add(state->room, member_id, MEMBER_STATE_INVITED);
 
 			// TODO: use this IRCv3 thing?
 			// http://ircv3.net/specs/extensions/invite-notify-3.2.html
 
-			if(state->flags & SYNC_INVITE){
-				yajl_val inviter = YAJL_GET(obj, yajl_t_string, ("sender"));
-				if(inviter){
-					state->inviter = inviter->u.string;
-				}
+			if((state->flags & SYNC_INVITE) && ev->sender){
+				state->inviter = ev->sender;
 			}
 		}
 	}
 }
 
-static void mtx_event_join_rules(struct sync_state* state, yajl_val obj){
-	yajl_val rule = YAJL_GET(obj, yajl_t_string, ("content", "join_rule"));
-	if(rule){
-		state->room->invite_only = strcmp(rule->u.string, "public") != 0;
+static void mtx_event_join_rules(struct sync_state* state, struct mtx_ev* ev){
+	if(ev->join_rule){
+		state->room->invite_only = strcmp(ev->join_rule, "public") != 0;
 	}
 }
 
-static void mtx_event_guest_access(struct sync_state* state, yajl_val obj){
+static void mtx_event_guest_access(struct sync_state* state, struct mtx_ev* ev){
 	// TODO: ??? change p/s mode on room?
 }
 
-static void mtx_event_create(struct sync_state* state, yajl_val obj){
-	yajl_val creation_ts = YAJL_GET(obj, yajl_t_number, ("origin_server_ts"));
-	if(YAJL_IS_INTEGER(creation_ts)){
-		state->room->created = creation_ts->u.number.i / 1000;
+static void mtx_event_create(struct sync_state* state, struct mtx_ev* ev){
+	if(MTX_EV_HAS(ev, ts)){
+		state->room->created = ev->ts / 1000;
 	}
 }
 
-static void mtx_event_aliases(struct sync_state* state, yajl_val obj){
-	yajl_val key = YAJL_GET(obj, yajl_t_string, ("state_key"));
-	yajl_val arr = YAJL_GET(obj, yajl_t_array,  ("content", "aliases"));
+static void mtx_event_aliases(struct sync_state* state, struct mtx_ev* ev){
+	json_val arr = ev->aliases;
 
-	if(!key || strcmp(key->u.string, global.mtx_server_name) != 0){
+	if(!arr || !ev->state_key || strcmp(ev->state_key, global.mtx_server_name) != 0){
 		return;
 	}
 
 	for(size_t i = 0; i < arr->u.array.len; ++i){
-		yajl_val v = arr->u.array.values[i];
-		if(!YAJL_IS_STRING(v)) continue;
+		json_val v = arr->u.array.values[i];
+		if(!JSON_IS_STRING(v)) continue;
 
-		sb_push(state->room->aliases, id_intern(v->u.string));
+		sb_push(state->room->aliases, id_intern(json_str(v)));
 	}
 
 }
 
-static void mtx_event_canon_alias(struct sync_state* state, yajl_val obj){
-	yajl_val alias = YAJL_GET(obj, yajl_t_string, ("content", "alias"));
-	if(alias){
-		printf("[%02d]     Canonical alias = [%s]\n", state->client->irc_sock, alias->u.string);
+static void mtx_event_canon_alias(struct sync_state* state, struct mtx_ev* ev){
+	if(ev->alias){
+		printf("[%s]     Canonical alias = [%s]\n", state->session->user, ev->alias);
 		free(state->room->canon);
-		state->room->canon = strdup(alias->u.string);
+		state->room->canon = strdup(ev->alias);
 	}
 }
 
-static void mtx_event_history_vis(struct sync_state* state, yajl_val obj){
+static void mtx_event_history_vis(struct sync_state* state, struct mtx_ev* ev){
 	// TODO: ???
 }
 
-static void mtx_event_power_levels(struct sync_state* state, yajl_val obj){
-	yajl_val users = YAJL_GET(obj, yajl_t_object, ("content", "users"));
-	if(users){
-		for(size_t i = 0; i < users->u.object.len; ++i){
-			const char* user = users->u.object.keys[i];
-			yajl_val power   = users->u.object.values[i];
-
-			struct member* member = room_member_add(state->room, id_intern(user), 0);
-
-			if(YAJL_IS_INTEGER(power)){
-				// TODO: if not SYNC_NEW_ROOM, check the old value
-				//       and send a MODE for +o, -o, +h, -h, etc
-				// XXX:  comparing old value is not safe w.r.t multiple clients,
-				//       assume if we get this during non new-room sync, then it changed?
-				member->power = power->u.number.i;
-			}
+// the IRC mode for a power level, matching the prefixes in irc_send_names
+static char mtx_event_power_mode(struct room* room, int power){
+	char prefix = room_member_prefix(room, power);
+	return prefix == '@' ? 'o' : prefix == '%' ? 'h' : 0;
+}
+
+static void mtx_event_power_levels(struct sync_state* state, struct mtx_ev* ev){
+	json_val users     = ev->users;
+	const char* sender = ev->sender;
+
+	if(!users) return;
+
+	int default_power = MTX_EV_HAS(ev, users_default) ? ev->users_default : 0;
+
+	int old_op  = state->room->op_level;
+	int old_hop = state->room->hop_level;
+
+	// @ for those who can change power levels, % for those who can kick
+	state->room->op_level  = MTX_EV_HAS(ev, power_level) ? ev->power_level : MTX_EV_HAS(ev, state_default) ? ev->state_default : 50;
+	state->room->hop_level = MTX_EV_HAS(ev, kick) ? ev->kick : 50;
+
+	// a change to these changes everyone's prefix, so MODEs below compare against the old ones
+	struct room old_levels = { .op_level = old_op, .hop_level = old_hop };
+
+	for(size_t i = 0; i < users->u.object.len; ++i){
+		room_member_add(state->room, id_intern(users->u.object.keys[i]), 0);
+	}
+
+	// room state is shared between sessions, so whichever sees the change first tells everyone.
+	char* irc_room = NULL;
+	bool show = sender && !(state->flags & SYNC_INVITE) && room_get_irc_info(state->room, state->session, &irc_room) > ROOM_IRC_QUERY;
+
+	sb_each(m, state->room->members){
+		const char* path[] = { id_lookup(m->id), NULL };
+		json_val power = json_get(users, path, JSON_NUMBER);
+
+		int new_power = JSON_IS_INTEGER(power) ? power->u.number.i : default_power;
+		char old_mode = mtx_event_power_mode(&old_levels, m->power);
+		char new_mode = mtx_event_power_mode(state->room, new_power);
+
+		m->power = new_power;
+		if(old_mode != new_mode){
+			room_names_update(state->room, m);
+		}
+
+		if(!show || old_mode == new_mode || m->state != MEMBER_STATE_JOINED) continue;
+
+		char* nick = cvt_m2i_user(m->id);
+		*strchrnul(nick, '!') = '\0';
+
+		// clients that are new to the room get the prefixes in NAMES instead
+		struct session* skip = (state->flags & SYNC_NEW_ROOM) ? state->session : NULL;
+
+		if(old_mode){
+			SESSION_BROADCAST_PF(skip, state->room, sender, SF_CVT_PREFIX, "MODE", irc_room, (char[]){ '-', old_mode, 0 }, nick);
+		}
+		if(new_mode){
+			SESSION_BROADCAST_PF(skip, state->room, sender, SF_CVT_PREFIX, "MODE", irc_room, (char[]){ '+', new_mode, 0 }, nick);
 		}
 	}
 }
 
-static void mtx_event_name(struct sync_state* state, yajl_val obj){
-	yajl_val name = YAJL_GET(obj, yajl_t_string, ("content", "name"));
-	if(name){
+static void mtx_event_name(struct sync_state* state, struct mtx_ev* ev){
+	if(ev->name){
 		free(state->room->display_name);
-		state->room->display_name = strdup(name->u.string);
+		state->room->display_name = strdup(ev->name);
 	}
 }
 
-typedef void event_fn(struct sync_state* state, yajl_val);
+typedef void event_fn(struct sync_state* state, struct mtx_ev*);
 
 static struct mtx_handler {
 	const char* event;
@@ -269,12 +511,126 @@ static struct mtx_handler {
 	{ "m.room.name"              , &mtx_event_name },
 };
 
-void mtx_event(const char* event, struct sync_state* state, yajl_val obj){
+static struct phash mtx_handler_hash;
+static struct handler_stats mtx_handler_stats[countof(mtx_handlers)];
+
+
+#define yajl_gen_strlit(j, str) yajl_gen_string(j, str, sizeof(str)-1)
+
+static void mtx_event_gen_types(yajl_gen json){
+	yajl_gen_strlit(json, "types");
+	yajl_gen_array_open(json);
 	for(size_t i = 0; i < countof(mtx_handlers); ++i){
-		struct mtx_handler* h = mtx_handlers + i;
-		if(strcmp(event, h->event) == 0){
-			h->func(state, obj);
-			break;
-		}
+		yajl_gen_string(json, mtx_handlers[i].event, strlen(mtx_handlers[i].event));
+	}
+	yajl_gen_array_close(json);
+}
+
+static void mtx_event_gen_none(yajl_gen json, const char* key){
+	yajl_gen_string(json, key, strlen(key));
+	yajl_gen_map_open(json);
+	yajl_gen_strlit(json, "not_types");
+	yajl_gen_array_open(json);
+	yajl_gen_strlit(json, "*");
+	yajl_gen_array_close(json);
+	yajl_gen_map_close(json);
+}
+
+char* mtx_event_filter(void){
+	yajl_gen json = yajl_gen_alloc(NULL);
+
+	yajl_gen_map_open(json);
+
+	yajl_gen_strlit(json, "event_fields");
+	yajl_gen_array_open(json);
+	for(size_t i = 0; i < countof(mtx_ev_fields); ++i){
+		yajl_gen_string(json, mtx_ev_fields[i].path, strlen(mtx_ev_fields[i].path));
+	}
+	yajl_gen_array_close(json);
+
+	yajl_gen_strlit(json, "presence");
+	yajl_gen_map_open(json);
+	yajl_gen_strlit(json, "types");
+	yajl_gen_array_open(json);
+	yajl_gen_strlit(json, "m.presence");
+	yajl_gen_array_close(json);
+	yajl_gen_map_close(json);
+
+	// event_fields strips m.direct's content, so this just tells us to go and fetch it.
+	yajl_gen_strlit(json, "account_data");
+	yajl_gen_map_open(json);
+	yajl_gen_strlit(json, "types");
+	yajl_gen_array_open(json);
+	yajl_gen_strlit(json, "m.direct");
+	yajl_gen_array_close(json);
+	yajl_gen_map_close(json);
+
+	yajl_gen_strlit(json, "room");
+	yajl_gen_map_open(json);
+	{
+		// only get members relevant to the timeline, the rest come from /members on demand.
+		yajl_gen_strlit(json, "state");
+		yajl_gen_map_open(json);
+		mtx_event_gen_types(json);
+		yajl_gen_strlit(json, "lazy_load_members");
+		yajl_gen_bool(json, 1);
+		yajl_gen_map_close(json);
+
+		yajl_gen_strlit(json, "timeline");
+		yajl_gen_map_open(json);
+		mtx_event_gen_types(json);
+		yajl_gen_strlit(json, "limit");
+		yajl_gen_integer(json, MTX_TIMELINE_LIMIT);
+		yajl_gen_map_close(json);
+
+		mtx_event_gen_none(json, "ephemeral");
+		mtx_event_gen_none(json, "account_data");
+	}
+	yajl_gen_map_close(json);
+
+	yajl_gen_map_close(json);
+
+	const uint8_t* buf = NULL;
+	size_t sz;
+	yajl_gen_get_buf(json, &buf, &sz);
+	char* result = strndup(buf, sz);
+
+	yajl_gen_free(json);
+	return result;
+}
+
+void mtx_event(struct sync_state* state, json_val obj){
+	if(!JSON_IS_OBJECT(obj)) return;
+
+	if(!mtx_ev_levels){
+		mtx_ev_levels_init();
+	}
+
+	if(!mtx_handler_hash.slots){
+		phash_init(&mtx_handler_hash, &mtx_handlers[0].event, sizeof(*mtx_handlers), countof(mtx_handlers), false);
 	}
+
+	struct mtx_ev ev = {};
+	mtx_ev_decode(&ev, 0, obj);
+	if(!ev.type) return;
+
+	int i = phash_find(&mtx_handler_hash, ev.type);
+	if(i == -1) return;
+
+	// a big sync has thousands of events, don't let their strings pile up until the end of it
+	struct scratch_pos scratch = scratch_save();
+	uint64_t start = cpu_ns();
+	mtx_handlers[i].func(state, &ev);
+
+	mtx_handler_stats[i].calls++;
+	mtx_handler_stats[i].cpu_ns += cpu_ns() - start;
+	scratch_restore(scratch);
+}
+
+// the counters of the index'th event handler, or NULL after the last one
+const struct handler_stats* mtx_event_stats(size_t index, const char** name){
+	if(index >= countof(mtx_handlers)) return NULL;
+
+	*name = mtx_handlers[index].event;
+	return mtx_handler_stats + index;
 }
@@ -12,6 +12,8 @@ static struct {
 } timer;
 
 static CURLM* curl;
+static uint64_t curl_deadline;         // when curl next wants a CURL_SOCKET_TIMEOUT action, or 0
+static sb(struct net_msg*) retry_list; // messages waiting out their backoff before being re-sent
 
 static struct sock* sock_new(int fd){
 	struct sock* s = malloc(sizeof(*s));
@@ -51,17 +53,31 @@ static int curl_cb_socket(CURL* c, curl_socket_t sock, int what, void* uarg, voi
 	return 0;
 }
 
-static int curl_cb_timer(CURLM* multi, long timeout_ms, void* uarg){
+// the timerfd is shared between curl's own timeouts and our retry schedule,
+// so it's always armed for whichever of those comes first.
+static void net_timer_arm(void){
 	struct itimerspec it = {};
+	uint64_t when = curl_deadline;
 
-	//printf("timer cb: %ld\n", timeout_ms);
+	sb_each(m, retry_list){
+		if(!when || (*m)->retry_at < when){
+			when = (*m)->retry_at;
+		}
+	}
 
-	if(timeout_ms != -1){
-		it.it_value.tv_sec  = timeout_ms / 1000;
-		it.it_value.tv_nsec = 1 + (timeout_ms % 1000) * 1000000L;
+	if(when){
+		it.it_value.tv_sec  = when / 1000;
+		it.it_value.tv_nsec = 1 + (when % 1000) * 1000000L;
 	}
 
-	timerfd_settime(timer.fd, 0, &it, NULL);
+	timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &it, NULL);
+}
+
+static int curl_cb_timer(CURLM* multi, long timeout_ms, void* uarg){
+	//printf("timer cb: %ld\n", timeout_ms);
+
+	curl_deadline = timeout_ms == -1 ? 0 : time_ms() + timeout_ms;
+	net_timer_arm();
 
 	return 0;
 }
@@ -73,11 +89,7 @@ static size_t net_curl_cb(char* ptr, size_t sz, size_t nmemb, void* data){
 	return total;
 }
 
-static int net_msg_sort(const void* _a, const void* _b){
-	struct net_msg* const* a = _a;
-	struct net_msg* const* b = _b;
-	return (*b)->type - (*a)->type;
-}
+static bool net_dispatch(void);
 
 bool net_init(void){
 
@@ -116,16 +128,16 @@ bool net_init(void){
 	if(curl_easy_perform(c) == CURLE_OK){
 		sb_push(data, 0);
 
-		yajl_val root = yajl_tree_parse(data, NULL, 0);
-		yajl_val serv = YAJL_GET(root, yajl_t_string, ("server_name"));
+		json_val root = json_parse(data, sb_count(data) - 1);
+		json_val serv = JSON_GET(root, JSON_STRING, ("server_name"));
 
 		if(serv){
-			printf("Upstream server_name: [%s]\n", serv->u.string);
-			global.mtx_server_name = strdup(serv->u.string);
+			printf("Upstream server_name: [%s]\n", json_str(serv));
+			global.mtx_server_name = strdup(json_str(serv));
 			got_server_name = true;
 		}
 
-		yajl_tree_free(root);
+		json_free(root);
 	}
 
 	curl_easy_cleanup(c);
@@ -141,74 +153,89 @@ void net_update(int emask, struct sock* s){
 	if(emask & EPOLLOUT) curlmask |= CURL_CSELECT_OUT;
 	if(emask & EPOLLERR) curlmask |= CURL_CSELECT_ERR;
 
+	uint64_t now = time_ms();
+
+	if(!s && curl_deadline && curl_deadline <= now){
+		curl_deadline = 0;
+	}
+
 	int blah;
 	curl_multi_socket_action(curl, s ? s->fd : CURL_SOCKET_TIMEOUT, curlmask, &blah);
 
+	// re-send any failed messages whose backoff has expired
+
+	for(size_t i = 0; i < sb_count(retry_list); /**/){
+		struct net_msg* msg = retry_list[i];
+		if(msg->retry_at <= now){
+			sb_erase(retry_list, i);
+			msg->retry_at = 0;
+			net_msg_send(msg);
+		} else {
+			++i;
+		}
+	}
+
+	while(net_dispatch());
+
+	net_timer_arm();
+}
+
+// processes the messages curl has finished with, returns false if there were none.
+static bool net_dispatch(void){
 	sb(struct net_msg*) done_list = NULL;
 
 	// get all the completed messages from curl
 
+	int blah;
+
 	CURLMsg* cm;
 	while((cm = curl_multi_info_read(curl, &blah))){
 		if(cm->msg != CURLMSG_DONE) continue;
 
-		struct client* client;
-		curl_easy_getinfo(cm->easy_handle, CURLINFO_PRIVATE, &client);
-
-		for(struct net_msg* msg = client->msgs; msg; msg = msg->next){
-			if(msg->curl == cm->easy_handle){
-				printf("[%02d] MTX msg [%s]\n", client->irc_sock, mtx_msg_strs[msg->type]);
-				sb_push(msg->data, 0);
-				sb_push(done_list, msg);
-				msg->done = true;
-
-				long status = 0L - cm->data.result;
-				if(-status == CURLE_OK){
-					curl_easy_getinfo(cm->easy_handle, CURLINFO_HTTP_CODE, &status);
-				}
-				msg->curl_status = status;
-			} else if(msg->done){
-				// this must be a completed SYNC that we deferred processing, add it again.
-				sb_push(done_list, msg);
-			}
-		}
-	}
-
-	if(!done_list) return;
+		struct net_msg* msg;
+		curl_easy_getinfo(cm->easy_handle, CURLINFO_PRIVATE, &msg);
 
-	// sort the messages so that SYNCs come last
-	qsort(done_list, sb_count(done_list), sizeof(struct net_msg*), &net_msg_sort);
-
-	sb_each(m, done_list){
-		struct net_msg* msg = *m;
-		struct client* client;
-		curl_easy_getinfo(msg->curl, CURLINFO_PRIVATE, &client);
+		printf("[%s] MTX msg [%s]\n", msg->session->user, mtx_msg_strs[msg->type]);
+		sb_push(msg->data, 0);
 
-		// count number of non-done messages this client has
-		int remaining_msgs = 0;
-		for(struct net_msg* tmp = client->msgs; tmp; tmp = tmp->next){
-			if(!tmp->done) remaining_msgs++;
+		long status = 0L - cm->data.result;
+		if(-status == CURLE_OK){
+			curl_easy_getinfo(cm->easy_handle, CURLINFO_HTTP_CODE, &status);
+			retry_record(msg->type, time_ms() - msg->sent_at);
 		}
-
-		// if there is a remaining message and this completed one is a SYNC, we need to wait
-		// until the other message completes first. otherwise duplicate messages can happen.
-		if(msg->type == MTX_MSG_SYNC && remaining_msgs){
-			*m = NULL; // so it doesn't get free'd in the next loop
-			continue;
+		msg->curl_status = status;
+
+		long delay = retry_backoff(msg);
+		if(delay >= 0){
+			printf("[%s] MTX msg [%s] failed [%ld], retry %d in %ldms\n",
+			       msg->session->user, mtx_msg_strs[msg->type], status, msg->attempts + 1, delay);
+
+			curl_multi_remove_handle(curl, msg->curl);
+			sb_free(msg->data);
+
+			msg->attempts++;
+			curl_easy_setopt(msg->curl, CURLOPT_TIMEOUT_MS, retry_timeout(msg));
+			msg->retry_at = time_ms() + delay;
+			sb_push(retry_list, msg);
+		} else {
+			sb_push(done_list, msg);
 		}
+	}
+
+	if(!done_list) return false;
 
-		mtx_recv(client, msg);
+	// messages are handled in the order they completed. SYNCs no longer need to wait
+	// for our own sends to finish, mtx_event_message matches echoes by transaction id.
+	sb_each(m, done_list){
+		mtx_recv((*m)->session, *m);
 	}
 
 	// free completed messages
 	sb_each(m, done_list){
 		struct net_msg* msg = *m;
-		if(!msg) continue;
-
-		struct client* client;
-		curl_easy_getinfo(msg->curl, CURLINFO_PRIVATE, &client);
+		struct session* sess = msg->session;
 
-		for(struct net_msg** p = &client->msgs; *p; /**/){
+		for(struct net_msg** p = &sess->msgs; *p; /**/){
 			if(*p == msg){
 				*p = msg->next;
 				net_msg_free(msg);
@@ -219,11 +246,14 @@ void net_update(int emask, struct sock* s){
 	}
 
 	sb_free(done_list);
+	return true;
 }
 
-struct net_msg* net_msg_new(struct client* client, int type){
+struct net_msg* net_msg_new(struct session* sess, int type){
 	struct net_msg* msg = calloc(1, sizeof(*msg));
-	
+	msg->type = type;
+	msg->session = sess;
+
 	msg->curl = curl_easy_init();
 	curl_easy_setopt(msg->curl, CURLOPT_ACCEPT_ENCODING, "");
 	curl_easy_setopt(msg->curl, CURLOPT_USERAGENT, "morpheus");
@@ -231,7 +261,7 @@ struct net_msg* net_msg_new(struct client* client, int type){
 	curl_easy_setopt(msg->curl, CURLOPT_WRITEFUNCTION, &net_curl_cb);
 	curl_easy_setopt(msg->curl, CURLOPT_WRITEDATA, &msg->data);
 
-	curl_easy_setopt(msg->curl, CURLOPT_PRIVATE, client);
+	curl_easy_setopt(msg->curl, CURLOPT_PRIVATE, msg);
 	curl_easy_setopt(msg->curl, CURLOPT_SSL_VERIFYHOST, 0L);
 	curl_easy_setopt(msg->curl, CURLOPT_SSL_VERIFYPEER, 0L);
 	curl_easy_setopt(msg->curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
@@ -242,12 +272,11 @@ struct net_msg* net_msg_new(struct client* client, int type){
 		// XXX: breaks other GETs if they're pipelined onto the sync request
 		//      so only enable it for sync itself (even this causes issues? investigate)
 		// curl_easy_setopt(msg->curl, CURLOPT_PIPEWAIT, 1L);
-		curl_easy_setopt(msg->curl, CURLOPT_TIMEOUT, 100);
-	} else {
-		// all the non-sync messages should complete timely, if not something is busted.
-		curl_easy_setopt(msg->curl, CURLOPT_TIMEOUT, 10);
 	}
 
+	// derived from observed latencies, see retry.c
+	curl_easy_setopt(msg->curl, CURLOPT_TIMEOUT_MS, retry_timeout(msg));
+
 	//curl_easy_setopt(msg->curl, CURLOPT_VERBOSE, 1L);
 
 	msg->headers = curl_slist_append(msg->headers, "Content-Type: application/json");
@@ -255,20 +284,34 @@ struct net_msg* net_msg_new(struct client* client, int type){
 
 	curl_easy_setopt(msg->curl, CURLOPT_HTTPHEADER, msg->headers);
 
-	msg->type = type;
-
-	struct net_msg** p = &client->msgs;
+	struct net_msg** p = &sess->msgs;
 	while(*p) p = &(*p)->next;
 	*p = msg;
 
 	return msg;
 }
 
+// starts any newly added transfers now, rather than on the next trip around the epoll loop.
+void net_flush(void){
+	int blah;
+	curl_multi_socket_action(curl, CURL_SOCKET_TIMEOUT, 0, &blah);
+}
+
 void net_msg_send(struct net_msg* msg){
+	msg->sent_at = time_ms();
 	curl_multi_add_handle(curl, msg->curl);
 }
 
 void net_msg_free(struct net_msg* msg){
+	if(msg->retry_at){
+		sb_each(m, retry_list){
+			if(*m == msg){
+				sb_erase(retry_list, m - retry_list);
+				break;
+			}
+		}
+	}
+
 	sb_free(msg->data);
 	curl_multi_remove_handle(curl, msg->curl);
 	curl_easy_cleanup(msg->curl);
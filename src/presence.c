@@ -35,7 +35,7 @@ static enum pres_status pres_lookup(const char* str){
 	else return PRES_OFFLINE;
 }
 
-bool presence_update(struct client* client, mtx_id id, const char* pres_str){
+bool presence_update(struct session* sess, mtx_id id, const char* pres_str){
 	if(!pres_ht.memory){
 		inso_ht_init(&pres_ht, 32, sizeof(struct presence), &pres_hash);
 	}
@@ -50,7 +50,7 @@ bool presence_update(struct client* client, mtx_id id, const char* pres_str){
 			p->status = status;
 			p->last_updated = now;
 			updated = true;
-		} else if(p->last_updated > client->last_sync){
+		} else if(p->last_updated > sess->last_sync){
 			updated = true;
 		}
 	} else {
@@ -65,3 +65,46 @@ bool presence_update(struct client* client, mtx_id id, const char* pres_str){
 
 	return updated;
 }
+
+void presence_forget(mtx_id id){
+	if(!pres_ht.memory) return;
+	inso_ht_del(&pres_ht, pres_hash(&id), &pres_cmp, I2V(id));
+}
+
+// forgets the users that aren't in any room we know of. presence_forget covers the
+// ones leaving their last room, but presence also comes in for people who never
+// got that far, like the lazy-loaded members we've not been told about yet.
+void presence_tick(void){
+	if(!pres_ht.memory) return;
+
+	// so that everything is in pres_ht.memory
+	while(inso_ht_tick(&pres_ht));
+
+	sb(mtx_id) gone = NULL;
+	for(size_t i = 0; i < pres_ht.capacity; ++i){
+		struct presence* p = (struct presence*)(pres_ht.memory + i * pres_ht.elem_size);
+		if(!p->last_updated) continue; // empty slot
+
+		size_t count;
+		room_user_rooms(p->member, &count);
+		if(!count) sb_push(gone, p->member);
+	}
+
+	// not in the loop above, deleting moves the other entries around
+	sb_each(id, gone) presence_forget(*id);
+	sb_free(gone);
+}
+
+// the AWAY message for a user, or NULL if they're online or we don't know.
+const char* presence_away(mtx_id id){
+	if(!pres_ht.memory) return NULL;
+
+	struct presence* p = inso_ht_get(&pres_ht, pres_hash(&id), &pres_cmp, I2V(id));
+	if(!p) return NULL;
+
+	switch(p->status){
+		case PRES_UNAVAILABLE: return "Idle";
+		case PRES_OFFLINE:     return "Offline";
+		default:               return NULL;
+	}
+}
@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include "morpheus.h"
+#include "inso_ht.h"
+
+// Display names and avatars of the users we know about, for WHO / WHOIS.
+// These mostly come for free from the content of m.room.member events in sync;
+// anyone else is looked up with /profile in the background, a few at a time.
+
+#define I2V(x) ((void*)(uintptr_t)(x))
+
+#define PROFILE_FETCH_MAX     4  // concurrent /profile requests
+#define PROFILE_FETCH_TIMEOUT 60 // seconds until we give up on one
+
+struct profile {
+	mtx_id user; // must be first member
+	char* display_name;
+	char* avatar_url;
+};
+
+// A user we're looking up, and the clients waiting for their WHOIS.
+struct profile_fetch {
+	mtx_id  user;
+	time_t  sent; // 0 while still queued
+	sb(int) irc_socks;
+};
+
+static inso_ht profile_ht;
+static sb(struct profile_fetch) profile_fetches;
+
+static size_t profile_hash(const void* entry){
+	uint32_t x = *(uint32_t*)entry;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = (x >> 16) ^ x;
+	return x;
+}
+
+static bool profile_cmp(const void* entry, void* param){
+	return I2V(*(uint32_t*)entry) == param;
+}
+
+static struct profile* profile_lookup(mtx_id user){
+	if(!profile_ht.memory){
+		inso_ht_init(&profile_ht, 64, sizeof(struct profile), &profile_hash);
+	}
+	return inso_ht_get(&profile_ht, profile_hash(&user), &profile_cmp, I2V(user));
+}
+
+static void profile_set(char** dst, const char* src){
+	if(*dst && src && strcmp(*dst, src) == 0) return;
+	free(*dst);
+	*dst = (src && *src) ? strdup(src) : NULL;
+}
+
+void profile_update(mtx_id user, const char* display_name, const char* avatar_url){
+	struct profile* p = profile_lookup(user);
+	if(!p){
+		p = inso_ht_put(&profile_ht, &(struct profile){ .user = user });
+	}
+
+	profile_set(&p->display_name, display_name);
+	profile_set(&p->avatar_url, avatar_url);
+}
+
+bool profile_get(mtx_id user, const char** display_name, const char** avatar_url){
+	struct profile* p = profile_lookup(user);
+	if(!p) return false;
+
+	if(display_name) *display_name = p->display_name;
+	if(avatar_url)   *avatar_url   = p->avatar_url;
+	return true;
+}
+
+static void profile_pump(void){
+	int in_flight = 0;
+	sb_each(f, profile_fetches){
+		in_flight += !!f->sent;
+	}
+
+	struct session* sess = session_any();
+	if(!sess) return;
+
+	for(size_t i = 0; i < sb_count(profile_fetches) && in_flight < PROFILE_FETCH_MAX; ++i){
+		struct profile_fetch* f = profile_fetches + i;
+		if(f->sent) continue;
+
+		f->sent = time(0);
+		++in_flight;
+		mtx_send_profile(sess, f->user);
+	}
+}
+
+// answers the clients waiting on a fetch, then forgets about it.
+static void profile_fetch_done(size_t index, bool found){
+	struct profile_fetch f = profile_fetches[index];
+	sb_erase(profile_fetches, index);
+
+	sb_each(s, f.irc_socks){
+		struct client* client = client_find(*s);
+		if(!client) continue;
+
+		if(found){
+			irc_send_whois(client, f.user);
+		} else {
+			char* nick = cvt_m2i_user(f.user);
+			*strchrnul(nick, '!') = '\0';
+			IRC_SEND_NUM(client, "401", nick, "No such nick/channel");
+			IRC_SEND_NUM(client, "318", nick, "End of /WHOIS list.");
+		}
+	}
+	sb_free(f.irc_socks);
+}
+
+// queues a lookup of user, and a WHOIS reply to client once it's done (if not NULL).
+// Lookups of the same user are only done once, however many clients ask.
+void profile_fetch(struct client* client, mtx_id user){
+	struct profile_fetch* fetch = NULL;
+
+	sb_each(f, profile_fetches){
+		if(f->user == user){
+			fetch = f;
+			break;
+		}
+	}
+
+	if(!fetch){
+		sb_push(profile_fetches, (struct profile_fetch){ .user = user });
+		fetch = &sb_last(profile_fetches);
+	}
+
+	if(client){
+		sb_push(fetch->irc_socks, client->irc_sock);
+	}
+
+	profile_pump();
+}
+
+void profile_recv(struct session* sess, struct net_msg* msg, json_val root){
+	mtx_id user = (uintptr_t)msg->user_data;
+
+	size_t index = 0;
+	for(; index < sb_count(profile_fetches); ++index){
+		if(profile_fetches[index].user == user) break;
+	}
+
+	bool found = msg->curl_status == 200;
+
+	if(found){
+		json_val name   = JSON_GET(root, JSON_STRING, ("displayname"));
+		json_val avatar = JSON_GET(root, JSON_STRING, ("avatar_url"));
+		profile_update(user, json_str(name), json_str(avatar));
+	} else if(msg->curl_status != 404){
+		printf("[%s] PROFILE FAIL: [%ld] [%s]\n", sess->user, msg->curl_status, id_lookup(user));
+	}
+
+	if(index < sb_count(profile_fetches)){
+		profile_fetch_done(index, found);
+	}
+
+	profile_pump();
+}
+
+void profile_tick(void){
+	time_t now = time(0);
+
+	// the session doing the lookup might have gone away, so don't wait forever.
+	for(size_t i = 0; i < sb_count(profile_fetches); /**/){
+		struct profile_fetch* f = profile_fetches + i;
+		if(f->sent && now - f->sent >= PROFILE_FETCH_TIMEOUT){
+			profile_fetch_done(i, profile_lookup(f->user) != NULL);
+		} else {
+			++i;
+		}
+	}
+
+	profile_pump();
+}
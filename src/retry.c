@@ -0,0 +1,128 @@
+#include "morpheus.h"
+#include <stdio.h>
+
+// Retry budgets, backoff limits and timeout bounds for each type of net_msg.
+// All times are in milliseconds. A max_retries of -1 means retry forever.
+
+static const struct retry_policy {
+	int max_retries;
+	int backoff_base;
+	int backoff_max;
+	int timeout_min;
+	int timeout_max;
+} retry_policies[] = {
+	[MTX_MSG_SYNC]      = { -1, 1000, 60000, 10000, 45000 },
+	[MTX_MSG_LOGIN]     = {  2,  500,  4000,  5000, 20000 },
+	[MTX_MSG_MSG]       = {  4,  250,  8000,  5000, 20000 }, // PUT with txn id, safe to repeat
+	[MTX_MSG_TOPIC]     = {  4,  250,  8000,  5000, 20000 },
+	[MTX_MSG_JOIN]      = {  2,  500,  4000,  5000, 20000 },
+	[MTX_MSG_LEAVE]     = {  2,  500,  4000,  5000, 20000 },
+	[MTX_MSG_FILTER]    = {  2,  500,  4000,  5000, 20000 },
+	[MTX_MSG_MEMBERS]   = {  2,  500,  4000, 10000, 30000 },
+	[MTX_MSG_STATE]     = {  2,  500,  4000, 10000, 30000 },
+	[MTX_MSG_DIRECTORY] = {  2,  500,  4000, 10000, 30000 },
+	[MTX_MSG_PROFILE]   = {  2,  250,  2000,  5000, 20000 },
+	[MTX_MSG_DIRECT]    = {  2,  500,  4000,  5000, 20000 },
+	[MTX_MSG_DIRECT_SET]= {  4,  250,  8000,  5000, 20000 }, // PUT, safe to repeat
+	[MTX_MSG_PM_CREATE] = {  0,    0,     0,  5000, 20000 }, // not idempotent
+};
+
+// Timeout used until we have seen enough responses to estimate latency.
+#define RETRY_DEFAULT_TIMEOUT 10000
+#define RETRY_MIN_SAMPLES     8
+
+// A full-state sync has to put together the whole account before it answers, which
+// can take minutes on a big one. It gets this long, doubling with each retry.
+#define RETRY_FULL_SYNC_TIMEOUT     300000
+#define RETRY_FULL_SYNC_TIMEOUT_MAX 1200000
+
+struct latency_ring {
+	uint32_t samples[32];
+	uint32_t count;
+};
+
+static struct latency_ring latency[countof(retry_policies)];
+static struct latency_ring latency_all;
+
+static void latency_add(struct latency_ring* r, uint32_t ms){
+	r->samples[r->count++ % countof(r->samples)] = ms;
+}
+
+static long latency_p95(struct latency_ring* r){
+	size_t n = MIN((size_t)r->count, countof(r->samples));
+	if(n < RETRY_MIN_SAMPLES) return -1;
+
+	uint32_t s[countof(r->samples)];
+	memcpy(s, r->samples, n * sizeof(*s));
+
+	for(size_t i = 1; i < n; ++i){
+		uint32_t v = s[i];
+		size_t j = i;
+		for(; j > 0 && s[j-1] > v; --j) s[j] = s[j-1];
+		s[j] = v;
+	}
+
+	return s[(n * 95) / 100];
+}
+
+long retry_timeout(struct net_msg* msg){
+	int type = msg->type;
+	assert(type >= 0 && (size_t)type < countof(retry_policies));
+	const struct retry_policy* p = retry_policies + type;
+
+	if(type == MTX_MSG_SYNC && !msg->session->mtx_since){
+		return MIN((long)RETRY_FULL_SYNC_TIMEOUT << MIN(msg->attempts, 8), (long)RETRY_FULL_SYNC_TIMEOUT_MAX);
+	}
+
+	if(type == MTX_MSG_SYNC){
+		// sync latency is dominated by the long-poll itself, so the margin on top
+		// of it is derived from how long the other requests are taking.
+		long p95 = latency_p95(&latency_all);
+		long margin = p95 == -1 ? p->timeout_min : MIN(MAX(p95 * 4, (long)p->timeout_min), (long)p->timeout_max);
+		return MTX_SYNC_POLL_MS + margin;
+	}
+
+	long p95 = latency_p95(latency + type);
+	if(p95 == -1) p95 = latency_p95(&latency_all);
+	if(p95 == -1) return RETRY_DEFAULT_TIMEOUT;
+
+	return MIN(MAX(p95 * 4, (long)p->timeout_min), (long)p->timeout_max);
+}
+
+void retry_record(int type, long ms){
+	assert(type >= 0 && (size_t)type < countof(retry_policies));
+
+	if(type == MTX_MSG_SYNC || ms < 0) return;
+
+	latency_add(latency + type, ms);
+	latency_add(&latency_all, ms);
+}
+
+long retry_backoff(struct net_msg* msg){
+	assert(msg->type >= 0 && (size_t)msg->type < countof(retry_policies));
+	const struct retry_policy* p = retry_policies + msg->type;
+
+	long status = msg->curl_status;
+	bool transient = status <= 0 || status == 429 || status >= 500;
+
+	if(!transient) return -1;
+	if(p->max_retries != -1 && msg->attempts >= p->max_retries) return -1;
+
+	// exponential backoff with "equal jitter", so clients that failed at the same
+	// moment (e.g. a homeserver restart) don't all come back in lockstep.
+	long cap = MIN((long)p->backoff_max, (long)p->backoff_base << MIN(msg->attempts, 16));
+	long delay = cap / 2 + rand() % (cap / 2 + 1);
+
+	if(status == 429 && msg->data){
+		json_val root = json_parse_copy(msg->data, sb_count(msg->data) - 1);
+		json_val after = JSON_GET(root, JSON_NUMBER, ("retry_after_ms"));
+
+		if(JSON_IS_INTEGER(after)){
+			delay = MAX(delay, (long)after->u.number.i);
+		}
+
+		json_free(root);
+	}
+
+	return delay;
+}
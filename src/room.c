@@ -1,26 +1,132 @@
+#include <stdio.h>
 #include "morpheus.h"
+#include "inso_ht.h"
 
 // TODO: array vs linked list vs hash table etc ??
-static sb(struct room) room_list;
+// pointers, so that a room stays put while others come and go, see room_tick.
+static sb(struct room*) room_list;
+
+#define I2V(x) ((void*)(uintptr_t)(x))
+
+// The reverse of room->members, so finding who shares a room with someone doesn't
+// mean going through every member list. Kept up to date by room_member_add / del.
+// Only joined members are in it, the invited ones and those power_levels mentions
+// aren't sharing a channel with anyone.
+struct room_user {
+	mtx_id     user;
+	sb(mtx_id) rooms;
+};
+
+struct room_user_slot {
+	mtx_id   user; // must be first member
+	uint32_t index;
+};
+
+static inso_ht room_user_ht;
+static sb(struct room_user) room_users;
+
+static size_t room_user_hash(const void* entry){
+	uint32_t x = *(uint32_t*)entry;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = (x >> 16) ^ x;
+	return x;
+}
 
-struct room* room_new(mtx_id id){
-	sb_each(r, room_list){
-		if(id == r->id) return r;
+static bool room_user_cmp(const void* entry, void* param){
+	return I2V(*(uint32_t*)entry) == param;
+}
+
+static struct room_user_slot* room_user_slot(mtx_id user){
+	if(!room_user_ht.memory){
+		inso_ht_init(&room_user_ht, 256, sizeof(struct room_user_slot), &room_user_hash);
+	}
+	return inso_ht_get(&room_user_ht, room_user_hash(&user), &room_user_cmp, I2V(user));
+}
+
+static struct room_user* room_user_get(mtx_id user){
+	struct room_user_slot* slot = room_user_slot(user);
+	return slot ? room_users + slot->index : NULL;
+}
+
+static void room_user_link(mtx_id user, mtx_id room){
+	struct room_user* u = room_user_get(user);
+
+	if(!u){
+		struct room_user_slot slot = { .user = user, .index = sb_count(room_users) };
+		inso_ht_put(&room_user_ht, &slot);
+		sb_push(room_users, (struct room_user){ .user = user });
+		u = &sb_last(room_users);
+	}
+
+	sb_push(u->rooms, room);
+}
+
+static void room_user_unlink(mtx_id user, mtx_id room){
+	struct room_user_slot* slot = room_user_slot(user);
+	if(!slot) return;
+
+	uint32_t index = slot->index;
+	struct room_user* u = room_users + index;
+
+	sb_each(r, u->rooms){
+		if(*r == room){
+			sb_erase(u->rooms, r - u->rooms);
+			break;
+		}
 	}
 
-	struct room r = {
-		.id = id,
-	};
-	sb_push(room_list, r);
+	if(sb_count(u->rooms)) return;
 
-	return &sb_last(room_list);
+	// not in any room we know of any more, so nobody needs their presence either
+	sb_free(u->rooms);
+	inso_ht_del(&room_user_ht, room_user_hash(&user), &room_user_cmp, I2V(user));
+
+	size_t last = sb_count(room_users) - 1;
+	if(index != last){
+		room_users[index] = room_users[last];
+		room_user_slot(room_users[index].user)->index = index;
+	}
+	sb_pop(room_users);
+
+	presence_forget(user);
+}
+
+// the rooms user has joined. Only valid until the next member change.
+const mtx_id* room_user_rooms(mtx_id user, size_t* count){
+	struct room_user* u = room_user_get(user);
+	*count = u ? sb_count(u->rooms) : 0;
+	return u ? u->rooms : NULL;
+}
+
+// true if user is in one of the rooms the client has joined.
+bool room_user_shares(struct client* client, mtx_id user){
+	struct room_user* u = room_user_get(user);
+	if(!u) return false;
+
+	sb_each(r, u->rooms){
+		if(client_in_room(client, *r)) return true;
+	}
+	return false;
+}
+
+struct room* room_new(mtx_id id){
+	struct room* room = room_lookup_mtx(id);
+	if(room) return room;
+
+	room = calloc(1, sizeof(*room));
+	room->id = id;
+	sb_push(room_list, room);
+
+	return room;
 }
 
 struct room* room_lookup_irc(const char* chan){
 	size_t chan_sz = strlen(chan);
 
 	if(*chan == '#'){
-		sb_each(r, room_list){
+		sb_each(p, room_list){
+			struct room* r = *p;
 			const char* name = NULL;
 			if(r->canon){
 				name = r->canon;
@@ -41,7 +147,8 @@ struct room* room_lookup_irc(const char* chan){
 	} else if(*chan == '!'){
 		struct room* found = NULL;
 
-		sb_each(r, room_list){
+		sb_each(p, room_list){
+			struct room* r = *p;
 			if(!r->id) continue;
 			const char* id = id_lookup(r->id);
 			if(strncmp(chan, id, 9) == 0){
@@ -61,12 +168,181 @@ struct room* room_lookup_irc(const char* chan){
 
 struct room* room_lookup_mtx(mtx_id id){
 	sb_each(r, room_list){
-		if(id == r->id) return r;
+		if(id == (*r)->id) return *r;
 	}
 
 	return NULL;
 }
 
+// false if lazy-loading left out some of the room's members, see mtx_send_members
+bool room_members_loaded(struct room* room){
+	if(room->members_loaded || !room->has_summary) return true;
+
+	int joined = 0, invited = 0;
+	sb_each(m, room->members){
+		if(m->state == MEMBER_STATE_JOINED) joined++;
+		else if(m->state == MEMBER_STATE_INVITED) invited++;
+	}
+
+	return joined >= room->joined_count && invited >= room->invited_count;
+}
+
+// the number of people in the room, including the ones we haven't loaded yet.
+static size_t room_member_count(struct room* room){
+	if(room->has_summary && !room->members_loaded){
+		return MAX((size_t)(room->joined_count + room->invited_count), sb_count(room->members));
+	}
+	return sb_count(room->members);
+}
+
+// the other person in a room with 2 members, using the summary's heroes if needed.
+static mtx_id room_query_partner(struct room* room, struct session* sess){
+	bool in_room = false;
+	mtx_id partner = 0;
+
+	sb_each(m, room->members){
+		if(m->id == sess->mtx_id){
+			in_room = true;
+		} else if(!partner){
+			partner = m->id;
+		}
+	}
+
+	if(!partner && sb_count(room->heroes)){
+		partner = room->heroes[0];
+	}
+
+	return in_room ? partner : 0;
+}
+
+// '@' or '%' for members with enough power to be an op / half-op in IRC terms.
+char room_member_prefix(struct room* room, int power){
+	int op  = room->op_level  ?: 100;
+	int hop = room->hop_level ?: 50;
+
+	if(power >= op)  return '@';
+	if(power >= hop) return '%';
+	return 0;
+}
+
+// The 353 payloads for the room, kept up to date as members come and go so NAMES
+// doesn't have to rebuild them for every client. They're thrown away and rebuilt
+// when something changes for everyone at once, like the power level thresholds.
+
+#define ROOM_NAMES_LINE_MAX 400
+
+// localparts longer than this (the spec allows far less) are cut short in the list
+#define ROOM_NAMES_NICK_MAX 255u
+
+static bool room_names_listed(struct room* room, struct member* m){
+	if(!room->names_large) return true;
+	if(room_member_prefix(room, m->power)) return true;
+
+	sb_each(a, room->active){
+		if(*a == m->id) return true;
+	}
+	return false;
+}
+
+static size_t room_names_token(struct member* m, char prefix, char* out, size_t out_size){
+	const char* c = id_lookup(m->id) + 1;
+	size_t len = MIN((size_t)(strchrnul(c, ':') - c), ROOM_NAMES_NICK_MAX);
+
+	size_t n = 0;
+	if(prefix && out_size) out[n++] = prefix;
+	len = MIN(len, out_size - n);
+	memcpy(out + n, c, len);
+
+	return n + len;
+}
+
+// lines are NUL terminated, with the nicks separated by single spaces.
+static void room_names_append(struct room* room, const char* token, size_t len){
+	sb(char)* line = sb_count(room->names) ? &sb_last(room->names) : NULL;
+
+	if(!line || sb_count(*line) + len + 1 > ROOM_NAMES_LINE_MAX){
+		sb_push(room->names, NULL);
+		line = &sb_last(room->names);
+	} else if(sb_count(*line) > 1){
+		sb_last(*line) = ' ';
+	} else {
+		sb_pop(*line); // emptied by room_names_del
+	}
+
+	memcpy(sb_add(*line, len), token, len);
+	sb_push(*line, '\0');
+}
+
+static void room_names_add(struct room* room, struct member* m){
+	if(!room->names_valid || !room_names_listed(room, m)) return;
+
+	char token[ROOM_NAMES_NICK_MAX + 1];
+	size_t len = room_names_token(m, room_member_prefix(room, m->power), token, sizeof(token));
+	room_names_append(room, token, len);
+}
+
+static void room_names_del(struct room* room, struct member* m){
+	if(!room->names_valid) return;
+
+	const char* c = id_lookup(m->id) + 1;
+	size_t len = MIN((size_t)(strchrnul(c, ':') - c), ROOM_NAMES_NICK_MAX);
+
+	sb_each(line, room->names){
+		char* p = *line;
+		char* end = *line + sb_count(*line) - 1;
+
+		while(p < end){
+			char* tok_end = strchrnul(p, ' ');
+			char* nick = (*p == '@' || *p == '%') ? p + 1 : p;
+
+			if((size_t)(tok_end - nick) == len && memcmp(nick, c, len) == 0){
+				// take the token out, along with the space after it (or before it, if it's last)
+				char* from = p;
+				char* to   = tok_end;
+				if(*to == ' ')       ++to;
+				else if(from > *line) --from;
+
+				memmove(from, to, (*line + sb_count(*line)) - to);
+				stb__sbn(*line) -= to - from;
+				return;
+			}
+
+			p = *tok_end ? tok_end + 1 : tok_end;
+		}
+	}
+}
+
+void room_names_invalidate(struct room* room){
+	sb_each(line, room->names) sb_free(*line);
+	sb_free(room->names);
+	room->names_valid = false;
+}
+
+// call when something about m that NAMES shows (i.e. its power) changes.
+void room_names_update(struct room* room, struct member* m){
+	room_names_del(room, m);
+	room_names_add(room, m);
+}
+
+// the 353 payloads for room, rebuilding them if needed.
+sb(char)* room_names_lines(struct room* room){
+	bool large = room_is_large(room);
+
+	if(room->names_valid && room->names_large == large){
+		return room->names;
+	}
+
+	room_names_invalidate(room);
+	room->names_valid = true;
+	room->names_large = large;
+
+	sb_each(m, room->members){
+		room_names_add(room, m);
+	}
+
+	return room->names;
+}
+
 struct member* room_member_get(struct room* room, mtx_id member_id){
 	assert(room);
 	sb_each(m, room->members){
@@ -83,9 +359,15 @@ struct member* room_member_add(struct room* room, mtx_id member_id, int state){
 		};
 		sb_push(room->members, mem);
 		result = &sb_last(room->members);
+		room_names_add(room, result);
 	}
 
-	if(state != MEMBER_STATE_NONE){
+	if(state != MEMBER_STATE_NONE && state != result->state){
+		if(state == MEMBER_STATE_JOINED){
+			room_user_link(member_id, room->id);
+		} else if(result->state == MEMBER_STATE_JOINED){
+			room_user_unlink(member_id, room->id);
+		}
 		result->state = state;
 	}
 
@@ -95,7 +377,10 @@ struct member* room_member_add(struct room* room, mtx_id member_id, int state){
 void room_member_del(struct room* room, mtx_id member_id){
 	struct member* result = room_member_get(room, member_id);
 	if(result){
+		bool joined = result->state == MEMBER_STATE_JOINED;
+		room_names_del(room, result);
 		sb_erase(room->members, result - room->members);
+		if(joined) room_user_unlink(member_id, room->id);
 	}
 }
 
@@ -161,12 +446,13 @@ static void room_choose_alias(struct room* room){
 	room->chosen_alias = id;
 }
 
-int room_get_irc_info(struct room* room, struct client* client, char** name){
+// the IRC name goes in scratch memory, see scratch_alloc
+int room_get_irc_info(struct room* room, struct session* sess, char** name){
 
 	if(room->canon){
 
 		if(name){
-			*name = strndup(room->canon, strchrnul(room->canon, ':') - room->canon);
+			*name = scratch_strndup(room->canon, strchrnul(room->canon, ':') - room->canon);
 		}
 		return ROOM_IRC_CHANNEL;
 
@@ -178,28 +464,27 @@ int room_get_irc_info(struct room* room, struct client* client, char** name){
 
 		if(name){
 			const char* alias = id_lookup(room->chosen_alias);
-			*name = strndup(alias, strchrnul(alias, ':') - alias);
+			*name = scratch_strndup(alias, strchrnul(alias, ':') - alias);
 		}
 		return ROOM_IRC_CHANNEL;
 
-	} else if(sb_count(room->members) == 2){
+	} else if(room_member_count(room) == 2){
 
-		for(size_t i = 0; i < 2; ++i){
-			if(room->members[i].id == client->mtx_id){
-				if(name){
-					*name = cvt_m2i_user(room->members[i ^ 1].id);
-					*strchrnul(*name, '!') = '\0';
-				}
-				return ROOM_IRC_QUERY;
+		mtx_id partner = room_query_partner(room, sess);
+		if(partner){
+			if(name){
+				*name = cvt_m2i_user(partner);
+				*strchrnul(*name, '!') = '\0';
 			}
+			return ROOM_IRC_QUERY;
 		}
 
-	} else if(sb_count(room->members) > 2){
+	} else if(room_member_count(room) > 2){
 
 		sb_each(m, room->members){
-			if(m->id == client->mtx_id){
+			if(m->id == sess->mtx_id){
 				if(name){
-					asprintf(name, "!%8s", id_lookup(room->id) + 1);
+					*name = scratch_printf("!%8s", id_lookup(room->id) + 1);
 				}
 				return ROOM_IRC_GROUP;
 			}
@@ -209,24 +494,18 @@ int room_get_irc_info(struct room* room, struct client* client, char** name){
 	return ROOM_IRC_INVALID;
 }
 
-struct room* room_find_query(struct client* client, mtx_id partner){
-	sb_each(r, client->irc_rooms){
-		struct room* room = room_lookup_mtx(*r);
-		if(!room) continue;
+struct room* room_find_query(struct session* sess, mtx_id partner){
+	sb_each(p, room_list){
+		struct room* room = *p;
 		if(room->canon) continue;
-		if(sb_count(room->members) != 2) continue;
+		if(room_member_count(room) != 2) continue;
 
-		// TODO: check for invite-only?
+		struct member* self = room_member_get(room, sess->mtx_id);
+		if(!self || self->state != MEMBER_STATE_JOINED) continue;
 
-		bool found = true;
-		sb_each(m, room->members){
-			if(m->id != client->mtx_id && m->id != partner){
-				found = false;
-				break;
-			}
-		}
+		// TODO: check for invite-only?
 
-		if(found){
+		if(room_query_partner(room, sess) == partner){
 			return room;
 		}
 	}
@@ -234,6 +513,113 @@ struct room* room_find_query(struct client* client, mtx_id partner){
 	return NULL;
 }
 
+// rooms with this many members only show ops and recent speakers in NAMES,
+// everyone else appears when they say something.
+bool room_is_large(struct room* room){
+	return global.large_room_members > 0 && room_member_count(room) >= (size_t)global.large_room_members;
+}
+
+// moves user to the front of the room's recent speakers, returns true if they weren't
+// there already (and so haven't been shown to IRC yet).
+bool room_touch_active(struct room* room, mtx_id user){
+	sb_each(a, room->active){
+		if(*a == user){
+			size_t i = a - room->active;
+			memmove(room->active + i, room->active + i + 1, (sb_count(room->active) - i - 1) * sizeof(mtx_id));
+			sb_last(room->active) = user;
+			return false;
+		}
+	}
+
+	if(sb_count(room->active) >= ROOM_ACTIVE_MAX){
+		struct member* oldest = room_member_get(room, room->active[0]);
+		sb_erase(room->active, 0);
+		if(oldest && !room_member_prefix(room, oldest->power)){
+			room_names_del(room, oldest);
+		}
+	}
+	sb_push(room->active, user);
+
+	struct member* m = room_member_get(room, user);
+	if(m && !room_member_prefix(room, m->power)){
+		room_names_add(room, m);
+	}
+
+	return true;
+}
+
+// forgets user as a recent speaker, returns true if they were one.
+bool room_drop_active(struct room* room, mtx_id user){
+	sb_each(a, room->active){
+		if(*a == user){
+			sb_erase(room->active, a - room->active);
+
+			struct member* m = room_member_get(room, user);
+			if(m && !room_member_prefix(room, m->power)){
+				room_names_del(room, m);
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+// for iterating over every room, returns NULL once index is past the end.
+struct room* room_at(size_t index){
+	return index < sb_count(room_list) ? room_list[index] : NULL;
+}
+
+// a client is showing room in IRC, it's kept around at least until room_unref.
+void room_ref(struct room* room){
+	room->refs++;
+}
+
+void room_unref(struct room* room){
+	assert(room->refs > 0);
+	room->refs--;
+}
+
 void room_free(struct room* room){
+	sb_each(r, room_list){
+		if(*r == room){
+			sb_erase(room_list, r - room_list);
+			break;
+		}
+	}
+
+	sb_each(m, room->members){
+		if(m->state == MEMBER_STATE_JOINED) room_user_unlink(m->id, room->id);
+	}
+	sb_free(room->members);
+
+	sb_each(l, room->names) sb_free(*l);
+	sb_free(room->names);
+
+	sb_free(room->aliases);
+	sb_free(room->heroes);
+	sb_free(room->active);
+
+	free(room->canon);
+	free(room->display_name);
+	free(room->topic);
+	free(room);
+}
+
+// gets rid of rooms that no client is showing and no session is in, or invited to.
+// They'd otherwise pile up from leaves, declined invites and sessions that are gone.
+// A session that's detached keeps its rooms, since its syncs only send what changed.
+void room_tick(void){
+	for(size_t i = 0; i < sb_count(room_list); /**/){
+		struct room* room = room_list[i];
+
+		if(room->refs || session_in_room(room)){
+			++i;
+			continue;
+		}
+
+		printf("Forgetting room [%s] (%zu members)\n", id_lookup(room->id), sb_count(room->members));
+		room_free(room);
+	}
 
+	presence_tick();
 }
@@ -0,0 +1,299 @@
+#include <crypt.h>
+#include <stdio.h>
+#include <string.h>
+#include "morpheus.h"
+
+static struct session* session_list;
+
+static char* session_hash(const char* pass, const char* setting){
+	void* data = NULL;
+	int size = 0;
+
+	char* hash = crypt_ra(pass, setting, &data, &size);
+	char* result = (hash && *hash != '*') ? strdup(hash) : NULL;
+
+	if(data){
+		memset(data, 0, size);
+		free(data);
+	}
+
+	return result;
+}
+
+static struct session* session_new(const char* user, const char* pass){
+	struct session* sess = calloc(1, sizeof(*sess));
+
+	sess->user = strdup(user);
+
+	char* salt = crypt_gensalt_ra("$6$", 0, NULL, 0);
+	if(salt){
+		sess->pass_hash = session_hash(pass, salt);
+		free(salt);
+	}
+
+	struct session** s = &session_list;
+	while(*s) s = &(*s)->next;
+	*s = sess;
+
+	return sess;
+}
+
+static void session_del(struct session* sess){
+	printf("[%s] --- Session destroyed. ---\n", sess->user);
+
+	assert(sb_count(sess->clients) == 0);
+
+	for(struct net_msg* msg = sess->msgs; msg; /**/){
+		struct net_msg* tmp = msg->next;
+		mtx_msg_abandon(msg);
+		net_msg_free(msg);
+		msg = tmp;
+	}
+
+	sb_each(s, sess->mtx_sent) free(s->event_id);
+	sb_free(sess->mtx_sent);
+
+	sb_each(o, sess->room_ops) mtx_room_op_free(*o);
+	sb_free(sess->room_ops);
+	sb_free(sess->sync_joins);
+
+	direct_free(sess);
+
+	sb_each(l, sess->backlog) free(l->line);
+	sb_free(sess->backlog);
+	sb_free(sess->clients);
+
+	free(sess->user);
+	free(sess->pass_hash);
+	free(sess->mtx_token);
+	free(sess->mtx_since);
+	free(sess->mtx_server);
+	free(sess->mtx_filter);
+	free(sess->mtx_device);
+
+	for(struct session** s = &session_list; *s; s = &(*s)->next){
+		if(*s == sess){
+			*s = (*s)->next;
+			break;
+		}
+	}
+
+	free(sess);
+}
+
+// finds the session these credentials belong to, so that clients logging in as the same
+// user share one sync stream. This includes sessions that are still logging in.
+static struct session* session_find(const char* user, const char* pass){
+	for(struct session* sess = session_list; sess; sess = sess->next){
+		if(!sess->pass_hash || sess->dead) continue;
+		if(!sess->mtx_token && !sb_count(sess->clients)) continue;
+		if(strcmp(sess->user, user) != 0) continue;
+
+		char* hash = session_hash(pass, sess->pass_hash);
+		bool match = hash && strcmp(hash, sess->pass_hash) == 0;
+		free(hash);
+
+		if(match) return sess;
+	}
+
+	return NULL;
+}
+
+void session_login(struct client* client){
+	assert(client->irc_nick);
+	assert(client->irc_pass);
+
+	struct session* sess = session_find(client->irc_nick, client->irc_pass);
+
+	if(sess){
+		printf("[%s] --- Session joined by [%02d] (%zu clients). ---\n", sess->user, client->irc_sock, sb_count(sess->clients) + 1);
+		session_attach(sess, client);
+	} else {
+		sess = session_new(client->irc_nick, client->irc_pass);
+		printf("[%s] --- Session created by [%02d]. ---\n", sess->user, client->irc_sock);
+		session_attach(sess, client);
+		mtx_send_login(sess, client->irc_nick, client->irc_pass);
+	}
+
+	{
+		volatile char *p = client->irc_pass;
+		while(*p) *p++ = 0;
+		free(client->irc_pass);
+		client->irc_pass = NULL;
+	}
+}
+
+// adds a client to the session. If it's already logged in, the client is brought
+// up to date straight away, otherwise that happens when the LOGIN response arrives.
+void session_attach(struct session* sess, struct client* client){
+	sb_push(sess->clients, client);
+	client->session = sess;
+	sess->detach_time = 0;
+
+	if(!sess->mtx_token) return;
+
+	client->irc_state |= IRC_STATE_REGISTERED;
+	irc_send_welcome(client);
+
+	struct room* room;
+	for(size_t i = 0; (room = room_at(i)); ++i){
+		struct member* self = room_member_get(room, sess->mtx_id);
+		if(!self || self->state != MEMBER_STATE_JOINED) continue;
+
+		if(room_get_irc_info(room, sess, NULL) == ROOM_IRC_QUERY){
+			client_room_add(client, room);
+		} else if(!(client->irc_caps & IRC_CAP_LAZY_ATTACH)){
+			irc_attach_room(client, room);
+		}
+	}
+
+	// the lines already have a time tag, strip it if the client didn't ask for one.
+	sb_each(l, sess->backlog){
+		if(!l->room || client_in_room(client, l->room)){
+			const char* line = l->line;
+			if(*line == '@' && !(client->irc_caps & IRC_CAP_SERVER_TIME)){
+				line = strchrnul(line, ' ');
+				line += !!*line;
+			}
+
+			char buf[1024];
+			int len = snprintf(buf, sizeof(buf), "%s\r\n", line);
+			irc_send_raw(client, buf, MIN(len, (int)sizeof(buf) - 1));
+		}
+		free(l->line);
+	}
+	sb_free(sess->backlog);
+}
+
+void session_detach(struct client* client){
+	struct session* sess = client->session;
+	if(!sess) return;
+
+	sb_each(c, sess->clients){
+		if(*c == client){
+			sb_erase(sess->clients, c - sess->clients);
+			break;
+		}
+	}
+
+	client->session = NULL;
+
+	sb_each(s, sess->mtx_sent){
+		if(s->client == client) s->client = NULL;
+	}
+
+	if(sb_count(sess->clients) == 0){
+		printf("[%s] --- Session detached. ---\n", sess->user);
+		sess->detach_time = time(0);
+	}
+}
+
+void session_send(struct session* sess, struct room* room, struct irc_msg* msg){
+	session_send_except(sess, NULL, room, msg);
+}
+
+static void session_send_line(struct session* sess, struct client* skip, struct room* room, struct irc_msg* msg){
+	if(sb_count(sess->clients)){
+		// the line only differs between clients by whether it has tags (and the nick
+		// for SF_NUMERIC), so format it once for each and reuse it for the rest.
+		char buf[2][1024];
+		int len[2] = {};
+
+		sb_each(c, sess->clients){
+			if(*c == skip) continue;
+			if(room && !client_in_room(*c, room->id)) continue;
+
+			if(msg->flags & SF_NUMERIC){
+				irc_send(*c, msg);
+				continue;
+			}
+
+			int v = !!((*c)->irc_caps & IRC_CAP_SERVER_TIME);
+			if(!len[v]){
+				len[v] = irc_format(*c, msg, buf[v]);
+			}
+			if(len[v] > 0){
+				irc_send_raw(*c, buf[v], len[v]);
+			}
+		}
+	} else if(msg->flags & SF_BACKLOG){
+		char buf[1024];
+		int len = irc_format(NULL, msg, buf);
+		if(len < 0) return;
+
+		if(sb_count(sess->backlog) >= SESSION_BACKLOG_MAX){
+			free(sess->backlog[0].line);
+			sb_erase(sess->backlog, 0);
+		}
+
+		struct backlog_line l = {
+			.room = room ? room->id : 0,
+			.line = strndup(buf, len - 2),
+		};
+		sb_push(sess->backlog, l);
+	}
+}
+
+void session_send_except(struct session* sess, struct client* skip, struct room* room, struct irc_msg* msg){
+	struct irc_split split;
+
+	// for SF_NUMERIC, which puts each client's nick (or "*" in the backlog) in front
+	size_t nick_len = 1;
+	sb_each(c, sess->clients){
+		if((*c)->irc_nick) nick_len = MAX(nick_len, strlen((*c)->irc_nick));
+	}
+
+	if(!irc_split_init(&split, msg, nick_len)){
+		session_send_line(sess, skip, room, msg);
+		return;
+	}
+
+	struct irc_msg line = *msg;
+	const char* text;
+
+	while((text = irc_split_next(&split))){
+		line.params[line.pcount-1] = text;
+		session_send_line(sess, skip, room, &line);
+	}
+}
+
+void session_broadcast(struct session* skip, struct room* room, struct irc_msg* msg){
+	assert(room);
+
+	for(struct session* sess = session_list; sess; sess = sess->next){
+		if(sess != skip){
+			session_send(sess, room, msg);
+		}
+	}
+}
+
+// any logged in session, for requests that aren't specific to a user.
+struct session* session_any(void){
+	for(struct session* sess = session_list; sess; sess = sess->next){
+		if(sess->mtx_token && !sess->dead) return sess;
+	}
+	return NULL;
+}
+
+// true if any session's user is in room, or has been invited to it.
+bool session_in_room(struct room* room){
+	for(struct session* sess = session_list; sess; sess = sess->next){
+		if(sess->mtx_id && room_member_get(room, sess->mtx_id)) return true;
+	}
+	return false;
+}
+
+// gets rid of sessions that failed to log in or sync, or have been detached for too long.
+void session_tick(void){
+	time_t now = time(0);
+
+	for(struct session** s = &session_list; *s; /**/){
+		struct session* sess = *s;
+
+		if(sb_count(sess->clients) == 0 && (!sess->mtx_token || sess->dead || now - sess->detach_time >= global.detach_timeout)){
+			session_del(sess);
+		} else {
+			s = &(*s)->next;
+		}
+	}
+}
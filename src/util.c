@@ -1,84 +1,353 @@
 #include "morpheus.h"
 #include <stdarg.h>
-#include <yajl/yajl_gen.h>
+#include <stdio.h>
+#include <time.h>
 
-bool yajl_generate(char** out, const char* fmt, ...){
-	va_list va;
-	va_start(va, fmt);
-	bool result = false;
+// JSON request bodies are built from templates in the same little language
+// yajl_generate used to take, e.g. "{ 'body': %s, 'n': %i, 'ok': true }":
+//   'str'  a string literal      %s  a char* (NULL for null)
+//   %z     a size_t + char*      %i  a long long         %b  an int, as a bool
+// A template is compiled once (see JSON_TMPL) into runs of finished JSON with
+// holes for the arguments, so rendering one is just copying and escaping.
+
+enum {
+	JT_LIT,
+	JT_STR,
+	JT_STRN,
+	JT_INT,
+	JT_BOOL,
+};
+
+struct json_tmpl_op {
+	int    type;
+	size_t off; // for JT_LIT, into json_tmpl.lit
+	size_t len;
+};
+
+struct json_tmpl {
+	sb(struct json_tmpl_op) ops;
+	sb(char) lit;
+};
+
+static sb(char) json_out;
+
+// the fast path is copying runs of bytes that don't need escaping in one go.
+static void json_write_str(sb(char)* out, const char* s, size_t len){
+	static const char hex[] = "0123456789abcdef";
 
-	yajl_gen json = yajl_gen_alloc(NULL);
+	sb_push(*out, '"');
+
+	const char* run = s;
+	const char* end = s + len;
+
+	for(const char* p = s; p < end; ++p){
+		uint8_t c = *p;
+		if(c >= 0x20 && c != '"' && c != '\\') continue;
+
+		memcpy(sb_add(*out, p - run), run, p - run);
+		run = p + 1;
+
+		char* e = sb_add(*out, 2);
+		e[0] = '\\';
+		switch(c){
+			case '"':  e[1] = '"';  break;
+			case '\\': e[1] = '\\'; break;
+			case '\n': e[1] = 'n';  break;
+			case '\r': e[1] = 'r';  break;
+			case '\t': e[1] = 't';  break;
+			default: {
+				e[1] = 'u';
+				char* u = sb_add(*out, 4);
+				u[0] = '0';
+				u[1] = '0';
+				u[2] = hex[c >> 4];
+				u[3] = hex[c & 15];
+			} break;
+		}
+	}
+
+	memcpy(sb_add(*out, end - run), run, end - run);
+	sb_push(*out, '"');
+}
+
+static void json_tmpl_lit(struct json_tmpl* t, const char* s, size_t len){
+	struct json_tmpl_op* last = sb_count(t->ops) ? &sb_last(t->ops) : NULL;
+
+	if(!last || last->type != JT_LIT){
+		sb_push(t->ops, ((struct json_tmpl_op){ .type = JT_LIT, .off = sb_count(t->lit) }));
+		last = &sb_last(t->ops);
+	}
+
+	memcpy(sb_add(t->lit, len), s, len);
+	last->len += len;
+}
+
+struct json_tmpl* json_tmpl_compile(const char* fmt){
+	struct json_tmpl* t = calloc(1, sizeof(*t));
+
+	// what we're inside of, to know whether a ',' or ':' goes before the next value
+	struct {
+		char type;
+		int  count;
+	} stack[32] = {};
+	int depth = 0;
 
 	for(const char* p = fmt; *p; p += strspn(p, " ,:")){
 		int len = strcspn(p+1, " ,:") + 1;
 
+		if(*p == '}' || *p == ']'){
+			assert(depth > 0);
+			--depth;
+			json_tmpl_lit(t, p, 1);
+			p += len;
+			continue;
+		}
+
+		if(depth > 0){
+			int n = stack[depth-1].count++;
+			if(stack[depth-1].type == '{' && n % 2 == 1){
+				json_tmpl_lit(t, ":", 1);
+			} else if(n > 0){
+				json_tmpl_lit(t, ",", 1);
+			}
+		}
+
 		switch(*p){
 			case '{':
-				yajl_gen_map_open(json);
-				break;
-			case '}':
-				yajl_gen_map_close(json);
-				break;
 			case '[':
-				yajl_gen_array_open(json);
-				break;
-			case ']':
-				yajl_gen_array_close(json);
-				break;
-			case '\'':
-				yajl_gen_string(json, p+1, len-2);
+				assert(depth < (int)countof(stack));
+				stack[depth].type = *p;
+				stack[depth].count = 0;
+				++depth;
+				json_tmpl_lit(t, p, 1);
 				break;
+			case '\'': {
+				sb(char) s = NULL;
+				json_write_str(&s, p+1, len-2);
+				json_tmpl_lit(t, s, sb_count(s));
+				sb_free(s);
+			} break;
 			case '%': {
-				if(p[1] == 's'){
-					char* s = va_arg(va, char*);
-					if(s){
-						yajl_gen_string(json, s, strlen(s));
-					} else {
-						yajl_gen_null(json);
-					}
-				} else if(p[1] == 'z'){
-					size_t l = va_arg(va, size_t);
-					char* s = va_arg(va, char*);
-					if(s){
-						yajl_gen_string(json, s, l);
-					} else {
-						yajl_gen_null(json);
-					}
-				} else if(p[1] == 'i' || p[1] == 'd' || p[1] == 'l'){
-					long long l = va_arg(va, long long);
-					yajl_gen_integer(json, l);
-				} else if(p[1] == 'b'){
-					int b = va_arg(va, int);
-					yajl_gen_bool(json, b);
+				int type = p[1] == 's' ? JT_STR
+				         : p[1] == 'z' ? JT_STRN
+				         : p[1] == 'b' ? JT_BOOL
+				         : JT_INT;
+				assert(strchr("szbidl", p[1]));
+				sb_push(t->ops, ((struct json_tmpl_op){ .type = type }));
+			} break;
+			default: {
+				// true, false, null and numbers are written as they are
+				json_tmpl_lit(t, p, len);
+			} break;
+		}
+
+		p += len;
+	}
+
+	assert(depth == 0);
+	return t;
+}
+
+// fills in the template's holes. The result is only valid until the next call.
+const char* json_tmpl_render(struct json_tmpl* t, ...){
+	va_list va;
+	va_start(va, t);
+
+	if(json_out) stb__sbn(json_out) = 0;
+
+	sb_each(op, t->ops){
+		switch(op->type){
+			case JT_LIT:
+				memcpy(sb_add(json_out, op->len), t->lit + op->off, op->len);
+				break;
+			case JT_STR: {
+				const char* s = va_arg(va, const char*);
+				if(s){
+					json_write_str(&json_out, s, strlen(s));
 				} else {
-					goto out;
+					memcpy(sb_add(json_out, 4), "null", 4);
 				}
 			} break;
-			default: {
-				if(strncasecmp(p, "false", len) == 0){
-					yajl_gen_bool(json, 0);
-				} else if(strncasecmp(p, "true", len) == 0){
-					yajl_gen_bool(json, 1);
-				} else if(strncasecmp(p, "null", len) == 0){
-					yajl_gen_null(json);
+			case JT_STRN: {
+				size_t l = va_arg(va, size_t);
+				const char* s = va_arg(va, const char*);
+				if(s){
+					json_write_str(&json_out, s, l);
+				} else {
+					memcpy(sb_add(json_out, 4), "null", 4);
+				}
+			} break;
+			case JT_INT: {
+				char buf[32];
+				int n = snprintf(buf, sizeof(buf), "%lld", va_arg(va, long long));
+				memcpy(sb_add(json_out, n), buf, n);
+			} break;
+			case JT_BOOL: {
+				if(va_arg(va, int)){
+					memcpy(sb_add(json_out, 4), "true", 4);
 				} else {
-					yajl_gen_number(json, p, len);
+					memcpy(sb_add(json_out, 5), "false", 5);
 				}
 			} break;
 		}
+	}
+
+	sb_push(json_out, 0);
+	va_end(va);
+
+	return json_out;
+}
+
+uint64_t time_ms(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t cpu_ns(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Perfect hashes for the handler tables: the seed is searched for when the table
+// is first used, so that every name gets a slot of its own and finding a handler
+// is one hash plus one compare.
+
+static uint32_t phash_hash(const struct phash* ph, const char* key){
+	uint32_t h = 2166136261u ^ ph->seed;
+	for(const char* c = key; *c; ++c){
+		h = (h ^ (uint8_t)(ph->nocase ? (*c | 0x20) : *c)) * 16777619u;
+	}
+	return (h ^ (h >> 15)) & ph->mask;
+}
+
+static const char* phash_key(const struct phash* ph, size_t index){
+	return *(const char**)((const char*)ph->keys + index * ph->stride);
+}
+
+// keys is the first of count names, each stride bytes apart (i.e. the first member
+// of an array of structs).
+void phash_init(struct phash* ph, const void* keys, size_t stride, size_t count, bool nocase){
+	ph->keys   = keys;
+	ph->stride = stride;
+	ph->nocase = nocase;
+
+	uint32_t size = 8;
+	while(size < count * 4) size <<= 1;
+	ph->mask = size - 1;
+	ph->slots = malloc(size * sizeof(*ph->slots));
+
+	for(ph->seed = 0;; ++ph->seed){
+		memset(ph->slots, 0xff, size * sizeof(*ph->slots));
+
+		size_t i = 0;
+		for(; i < count; ++i){
+			int16_t* s = ph->slots + phash_hash(ph, phash_key(ph, i));
+			if(*s != -1) break;
+			*s = i;
+		}
 
-		p += len;
+		if(i == count) break;
+
+		// a bigger table makes a seed without collisions easier to find
+		if(ph->seed == 64){
+			size <<= 1;
+			ph->mask = size - 1;
+			ph->slots = realloc(ph->slots, size * sizeof(*ph->slots));
+			ph->seed = 0;
+		}
 	}
+}
+
+// the index of key, or -1 if it isn't there
+int phash_find(const struct phash* ph, const char* key){
+	int i = ph->slots[phash_hash(ph, key)];
+	if(i == -1) return -1;
+
+	const char* k = phash_key(ph, i);
+	return (ph->nocase ? strcasecmp(key, k) : strcmp(key, k)) == 0 ? i : -1;
+}
+
+// A scratch arena for strings that are only needed until the current IRC command
+// or sync has been dealt with. Nothing is freed individually: scratch_restore
+// rewinds to an earlier scratch_save, and the blocks are kept for the next time,
+// so once it has grown to fit a busy sync it doesn't touch malloc at all.
 
-	const uint8_t* buf = NULL;
-	size_t sz;
-	yajl_gen_get_buf(json, &buf, &sz);
-	*out = strndup(buf, sz);
-	result = true;
+#define SCRATCH_BLOCK_SIZE (64 * 1024)
 
-out:
-	yajl_gen_free(json);
+struct scratch_block {
+	size_t size;
+	char data[];
+};
+
+static sb(struct scratch_block*) scratch_blocks;
+static struct scratch_pos scratch_cur;
+
+void* scratch_alloc(size_t sz){
+	sz = (sz + 7) & ~(size_t)7;
+
+	while(scratch_cur.block < sb_count(scratch_blocks)){
+		struct scratch_block* b = scratch_blocks[scratch_cur.block];
+		if(scratch_cur.used + sz <= b->size){
+			void* mem = b->data + scratch_cur.used;
+			scratch_cur.used += sz;
+			return mem;
+		}
+
+		// too small for this one, swap it out for one that fits
+		if(scratch_cur.used == 0){
+			free(b);
+			sb_erase(scratch_blocks, scratch_cur.block);
+			break;
+		}
+
+		++scratch_cur.block;
+		scratch_cur.used = 0;
+	}
+
+	size_t size = MAX((size_t)SCRATCH_BLOCK_SIZE, sz);
+	struct scratch_block* b = malloc(sizeof(*b) + size);
+	b->size = size;
+
+	// keep the blocks before this one where they are, they're still in use
+	sb_push(scratch_blocks, NULL);
+	memmove(scratch_blocks + scratch_cur.block + 1, scratch_blocks + scratch_cur.block,
+	        (sb_count(scratch_blocks) - scratch_cur.block - 1) * sizeof(*scratch_blocks));
+	scratch_blocks[scratch_cur.block] = b;
+
+	scratch_cur.used = sz;
+	return b->data;
+}
+
+char* scratch_strndup(const char* str, size_t len){
+	char* s = scratch_alloc(len + 1);
+	memcpy(s, str, len);
+	s[len] = '\0';
+	return s;
+}
+
+char* scratch_printf(const char* fmt, ...){
+	va_list va;
+
+	va_start(va, fmt);
+	int len = vsnprintf(NULL, 0, fmt, va);
 	va_end(va);
 
-	return result;
+	char* s = scratch_alloc(len + 1);
+
+	va_start(va, fmt);
+	vsnprintf(s, len + 1, fmt, va);
+	va_end(va);
+
+	return s;
+}
+
+struct scratch_pos scratch_save(void){
+	return scratch_cur;
+}
+
+void scratch_restore(struct scratch_pos pos){
+	assert(pos.block < scratch_cur.block || (pos.block == scratch_cur.block && pos.used <= scratch_cur.used));
+	scratch_cur = pos;
 }
@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include "morpheus.h"
+
+// Checks that parsing a big body (like an initial /sync) doesn't reserve much more
+// arena than the tree actually uses. Exits with 1 if it does.
+//
+//   make json_arena_test && ./json_arena_test
+
+#define TEST_EVENTS 200000
+
+// at most one block's worth of slack, see JSON_BLOCK_MAX in json.c
+#define TEST_MAX_SLACK (1024 * 1024)
+
+static char* test_body(size_t* len){
+	sb(char) body = NULL;
+	char buf[256];
+
+	const char* head = "{\"next_batch\":\"s1\",\"rooms\":{\"join\":{\"!a:x\":{\"timeline\":{\"events\":[";
+	memcpy(sb_add(body, strlen(head)), head, strlen(head));
+
+	for(int i = 0; i < TEST_EVENTS; ++i){
+		int n = snprintf(buf, sizeof(buf),
+			"%s{\"type\":\"m.room.message\",\"sender\":\"@user%d:x\",\"event_id\":\"$%d\","
+			"\"origin_server_ts\":%d,\"content\":{\"msgtype\":\"m.text\",\"body\":\"hello \\u00e9 %d\"}}",
+			i ? "," : "", i % 100, i, 1000000 + i, i);
+		memcpy(sb_add(body, n), buf, n);
+	}
+
+	const char* tail = "]}}}}}";
+	memcpy(sb_add(body, strlen(tail) + 1), tail, strlen(tail) + 1);
+
+	*len = sb_count(body) - 1;
+	return body;
+}
+
+static bool test_parse(const char* what, json_val root, size_t len){
+	size_t used, reserved;
+	json_arena_size(root, &used, &reserved);
+
+	json_val events = JSON_GET(root, JSON_ARRAY, ("rooms", "join", "!a:x", "timeline", "events"));
+	bool ok = events && events->u.array.len == TEST_EVENTS && reserved - used <= TEST_MAX_SLACK;
+
+	printf("%-16s %s: body %zu KB, arena used %zu KB, reserved %zu KB\n",
+	       what, ok ? "ok  " : "FAIL", len / 1024, used / 1024, reserved / 1024);
+
+	json_free(root);
+	return ok;
+}
+
+int main(void){
+	size_t len;
+	char* body = test_body(&len);
+	bool ok = true;
+
+	ok &= test_parse("json_parse_copy", json_parse_copy(body, len), len);
+	ok &= test_parse("json_parse", json_parse(body, len), len);
+
+	sb_free(body);
+	return ok ? 0 : 1;
+}
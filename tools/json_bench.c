@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <time.h>
+#include <yajl/yajl_tree.h>
+#include "morpheus.h"
+
+// Times json_parse against yajl_tree_parse on recorded response bodies, e.g. the
+// debug.json that mtx_recv can write out (see the #if 0 there).
+//
+//   make json_bench && ./json_bench debug.json [more.json ...]
+//
+// json_parse needs a fresh copy of the body each time since it works in place,
+// so that memcpy is counted against it.
+
+#define BENCH_ITERS 50
+
+static double bench_now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t bench_count_json(json_val v){
+	size_t n = 1;
+	if(JSON_IS_ARRAY(v)){
+		for(size_t i = 0; i < v->u.array.len; ++i) n += bench_count_json(v->u.array.values[i]);
+	} else if(JSON_IS_OBJECT(v)){
+		for(size_t i = 0; i < v->u.object.len; ++i) n += bench_count_json(v->u.object.values[i]);
+	}
+	return n;
+}
+
+static size_t bench_count_yajl(yajl_val v){
+	size_t n = 1;
+	if(YAJL_IS_ARRAY(v)){
+		for(size_t i = 0; i < v->u.array.len; ++i) n += bench_count_yajl(v->u.array.values[i]);
+	} else if(YAJL_IS_OBJECT(v)){
+		for(size_t i = 0; i < v->u.object.len; ++i) n += bench_count_yajl(v->u.object.values[i]);
+	}
+	return n;
+}
+
+static char* bench_read(const char* path, size_t* len){
+	FILE* f = fopen(path, "rb");
+	if(!f) return NULL;
+
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	char* buf = malloc(*len + 1);
+	*len = fread(buf, 1, *len, f);
+	buf[*len] = '\0';
+
+	fclose(f);
+	return buf;
+}
+
+int main(int argc, char** argv){
+	if(argc < 2){
+		fprintf(stderr, "Usage: %s file.json...\n", argv[0]);
+		return 1;
+	}
+
+	for(int i = 1; i < argc; ++i){
+		size_t len;
+		char* body = bench_read(argv[i], &len);
+		if(!body){
+			perror(argv[i]);
+			continue;
+		}
+
+		char* scratch = malloc(len + 1);
+		size_t nodes[2] = {};
+		double t[2];
+
+		t[0] = bench_now();
+		for(int j = 0; j < BENCH_ITERS; ++j){
+			yajl_val root = yajl_tree_parse(body, NULL, 0);
+			if(j == 0) nodes[0] = root ? bench_count_yajl(root) : 0;
+			yajl_tree_free(root);
+		}
+		t[0] = (bench_now() - t[0]) / BENCH_ITERS;
+
+		t[1] = bench_now();
+		for(int j = 0; j < BENCH_ITERS; ++j){
+			memcpy(scratch, body, len + 1);
+			json_val root = json_parse(scratch, len);
+			if(j == 0) nodes[1] = root ? bench_count_json(root) : 0;
+			json_free(root);
+		}
+		t[1] = (bench_now() - t[1]) / BENCH_ITERS;
+
+		printf("%s: %zu bytes\n", argv[i], len);
+		printf("  yajl_tree  %8.3f ms  %zu nodes\n", t[0], nodes[0]);
+		printf("  json_parse %8.3f ms  %zu nodes\n", t[1], nodes[1]);
+
+		free(scratch);
+		free(body);
+	}
+
+	return 0;
+}